@@ -118,6 +118,39 @@ static enum add_return add_uint32(lua_State *L, int index,
 	return ADD_OK;
 }
 
+static enum add_return add_int64(lua_State *L, int index,
+		DBusSignatureIter *type, DBusMessageIter *args)
+{
+	dbus_int64_t n;
+	if (!lua_isnumber(L, index))
+		return add_error(L, index, LUA_TNUMBER);
+	n = (dbus_int64_t)lua_tonumber(L, index);
+	dbus_message_iter_append_basic(args, DBUS_TYPE_INT64, &n);
+	return ADD_OK;
+}
+
+static enum add_return add_uint64(lua_State *L, int index,
+		DBusSignatureIter *type, DBusMessageIter *args)
+{
+	dbus_uint64_t n;
+	if (!lua_isnumber(L, index))
+		return add_error(L, index, LUA_TNUMBER);
+	n = (dbus_uint64_t)lua_tonumber(L, index);
+	dbus_message_iter_append_basic(args, DBUS_TYPE_UINT64, &n);
+	return ADD_OK;
+}
+
+static enum add_return add_double(lua_State *L, int index,
+		DBusSignatureIter *type, DBusMessageIter *args)
+{
+	double d;
+	if (!lua_isnumber(L, index))
+		return add_error(L, index, LUA_TNUMBER);
+	d = (double)lua_tonumber(L, index);
+	dbus_message_iter_append_basic(args, DBUS_TYPE_DOUBLE, &d);
+	return ADD_OK;
+}
+
 static enum add_return add_string(lua_State *L, int index,
 		DBusSignatureIter *type, DBusMessageIter *args)
 {
@@ -140,6 +173,21 @@ static enum add_return add_object_path(lua_State *L, int index,
 	return ADD_OK;
 }
 
+static enum add_return add_unix_fd(lua_State *L, int index,
+		DBusSignatureIter *type, DBusMessageIter *args)
+{
+	int fd;
+	if (!lua_isnumber(L, index))
+		return add_error(L, index, LUA_TNUMBER);
+	fd = (int)lua_tonumber(L, index);
+	/* libdbus sends a duplicate, so this fails on a bad fd */
+	if (!dbus_message_iter_append_basic(args, DBUS_TYPE_UNIX_FD, &fd)) {
+		lua_pushfstring(L, "(bad file descriptor %d)", fd);
+		return ADD_ERROR;
+	}
+	return ADD_OK;
+}
+
 static enum add_return add_array(lua_State *L, int index,
 		DBusSignatureIter *type, DBusMessageIter *args)
 {
@@ -187,6 +235,179 @@ static enum add_return add_array(lua_State *L, int index,
 	return ADD_OK;
 }
 
+static enum add_return add_dict(lua_State *L, int index,
+		DBusSignatureIter *type, DBusMessageIter *args)
+{
+	DBusSignatureIter entry_type;
+	DBusSignatureIter key_type;
+	DBusSignatureIter value_type;
+	DBusMessageIter array_args;
+	DBusMessageIter entry_args;
+	char *signature;
+	add_function kf;
+	add_function vf;
+
+	if (!lua_istable(L, index))
+		return add_error(L, index, LUA_TTABLE);
+
+	/* we push keys and values below, so make the index absolute */
+	if (index < 0)
+		index = lua_gettop(L) + index + 1;
+
+	dbus_signature_iter_recurse(type, &entry_type);
+	dbus_signature_iter_recurse(&entry_type, &key_type);
+	value_type = key_type;
+	dbus_signature_iter_next(&value_type);
+
+	kf = get_addfunc(&key_type);
+	vf = get_addfunc(&value_type);
+
+	signature = dbus_signature_iter_get_signature(&entry_type);
+	dbus_message_iter_open_container(args, DBUS_TYPE_ARRAY,
+			signature, &array_args);
+	dbus_free(signature);
+
+	lua_pushnil(L);
+	while (lua_next(L, index)) {
+		dbus_message_iter_open_container(&array_args,
+				DBUS_TYPE_DICT_ENTRY, NULL, &entry_args);
+
+		/* add a copy of the key, since converting the key
+		 * lua_next() is using to a string would confuse it */
+		lua_pushvalue(L, -2);
+		if (kf(L, -1, &key_type, &entry_args) != ADD_OK ||
+				vf(L, -2, &value_type, &entry_args) != ADD_OK) {
+			/* leave only the error message */
+			lua_replace(L, -4);
+			lua_pop(L, 2);
+			dbus_message_iter_abandon_container(&array_args,
+					&entry_args);
+			dbus_message_iter_abandon_container(args, &array_args);
+			return ADD_ERROR;
+		}
+
+		dbus_message_iter_close_container(&array_args, &entry_args);
+
+		/* pop the copy and value, keep key for lua_next() */
+		lua_pop(L, 2);
+	}
+
+	dbus_message_iter_close_container(args, &array_args);
+
+	return ADD_OK;
+}
+
+static enum add_return add_struct(lua_State *L, int index,
+		DBusSignatureIter *type, DBusMessageIter *args)
+{
+	DBusSignatureIter struct_type;
+	DBusMessageIter struct_args;
+	int i;
+
+	if (!lua_istable(L, index))
+		return add_error(L, index, LUA_TTABLE);
+
+	if (index < 0)
+		index = lua_gettop(L) + index + 1;
+
+	dbus_signature_iter_recurse(type, &struct_type);
+
+	dbus_message_iter_open_container(args, DBUS_TYPE_STRUCT,
+			NULL, &struct_args);
+
+	i = 1;
+	do {
+		lua_rawgeti(L, index, i);
+
+		if ((get_addfunc(&struct_type))(L, -1,
+					&struct_type, &struct_args) != ADD_OK) {
+			lua_insert(L, -2);
+			lua_pop(L, 1);
+			dbus_message_iter_abandon_container(args, &struct_args);
+			return ADD_ERROR;
+		}
+
+		lua_pop(L, 1);
+		i++;
+	} while (dbus_signature_iter_next(&struct_type));
+
+	dbus_message_iter_close_container(args, &struct_args);
+
+	return ADD_OK;
+}
+
+/*
+ * Guess a signature for a Lua value put in a variant.
+ * Tables with a value at index 1 are sent as arrays of variants,
+ * all other tables as string to variant dictionaries.
+ */
+static const char *variant_signature(lua_State *L, int index)
+{
+	switch (lua_type(L, index)) {
+	case LUA_TBOOLEAN:
+		return DBUS_TYPE_BOOLEAN_AS_STRING;
+	case LUA_TNUMBER:
+		{
+			lua_Number n = lua_tonumber(L, index);
+
+			if (n >= -2147483648.0 && n <= 2147483647.0 &&
+					n == (lua_Number)(dbus_int32_t)n)
+				return DBUS_TYPE_INT32_AS_STRING;
+		}
+		return DBUS_TYPE_DOUBLE_AS_STRING;
+	case LUA_TSTRING:
+		return DBUS_TYPE_STRING_AS_STRING;
+	case LUA_TTABLE:
+		{
+			int array;
+
+			lua_rawgeti(L, index, 1);
+			array = !lua_isnil(L, -1);
+			lua_pop(L, 1);
+
+			if (array)
+				return DBUS_TYPE_ARRAY_AS_STRING
+					DBUS_TYPE_VARIANT_AS_STRING;
+		}
+		return DBUS_TYPE_ARRAY_AS_STRING
+			DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+			DBUS_TYPE_STRING_AS_STRING
+			DBUS_TYPE_VARIANT_AS_STRING
+			DBUS_DICT_ENTRY_END_CHAR_AS_STRING;
+	}
+
+	return NULL;
+}
+
+static enum add_return add_variant(lua_State *L, int index,
+		DBusSignatureIter *type, DBusMessageIter *args)
+{
+	DBusSignatureIter variant_type;
+	DBusMessageIter variant_args;
+	const char *signature = variant_signature(L, index);
+
+	if (signature == NULL) {
+		lua_pushfstring(L, "(cannot send %s in a variant)",
+				lua_typename(L, lua_type(L, index)));
+		return ADD_ERROR;
+	}
+
+	dbus_signature_iter_init(&variant_type, signature);
+
+	dbus_message_iter_open_container(args, DBUS_TYPE_VARIANT,
+			signature, &variant_args);
+
+	if ((get_addfunc(&variant_type))(L, index,
+				&variant_type, &variant_args) != ADD_OK) {
+		dbus_message_iter_abandon_container(args, &variant_args);
+		return ADD_ERROR;
+	}
+
+	dbus_message_iter_close_container(args, &variant_args);
+
+	return ADD_OK;
+}
+
 static add_function get_addfunc(DBusSignatureIter *type)
 {
 	switch (dbus_signature_iter_get_current_type(type)) {
@@ -202,17 +423,45 @@ static add_function get_addfunc(DBusSignatureIter *type)
 		return add_int32;
 	case DBUS_TYPE_UINT32:
 		return add_uint32;
+	case DBUS_TYPE_INT64:
+		return add_int64;
+	case DBUS_TYPE_UINT64:
+		return add_uint64;
+	case DBUS_TYPE_DOUBLE:
+		return add_double;
 	case DBUS_TYPE_STRING:
 		return add_string;
 	case DBUS_TYPE_OBJECT_PATH:
 		return add_object_path;
+	case DBUS_TYPE_UNIX_FD:
+		return add_unix_fd;
 	case DBUS_TYPE_ARRAY:
+		if (dbus_signature_iter_get_element_type(type)
+				== DBUS_TYPE_DICT_ENTRY)
+			return add_dict;
 		return add_array;
+	case DBUS_TYPE_STRUCT:
+		return add_struct;
+	case DBUS_TYPE_VARIANT:
+		return add_variant;
 	}
 
 	return add_not_implemented;
 }
 
+/*
+ * Add the value at index as the single complete type in signature
+ */
+EXPORT unsigned int add_value(lua_State *L, int index,
+		const char *signature, DBusMessageIter *args)
+{
+	DBusSignatureIter type;
+
+	dbus_signature_iter_init(&type, signature);
+
+	return (get_addfunc(&type))(L, index, &type, args) != ADD_OK;
+}
+
 EXPORT unsigned int add_arguments(lua_State *L, int start, int argc,
 		const char *signature, DBusMessage *msg)
 {
@@ -19,6 +19,8 @@
 #ifndef _ADD_H
 #define _ADD_H
 
+unsigned int add_value(lua_State *L, int index,
+		const char *signature, DBusMessageIter *args);
 unsigned int add_arguments(lua_State *L, int start, int argc,
 		const char *signature, DBusMessage *msg);
 
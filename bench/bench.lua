@@ -0,0 +1,262 @@
+-- Benchmarks for SimpleDBus
+--
+-- Run with `make bench`, which starts a private dbus-daemon and
+-- runs this script as the server exporting the methods and as the
+-- client measuring them. Before that it is run to measure encoding
+-- and decoding of the arguments without a bus.
+--
+-- Every result is printed as a line of JSON with the fields
+--   name     what was measured
+--   n        number of operations
+--   seconds  wall clock time
+--   ops      operations per second
+--   us       microseconds per operation
+--   cpu      cpu seconds used by the client
+
+local DBus = require 'simpledbus'
+
+local NAME = 'org.lua.SimpleDBus.Bench'
+local PATH = '/org/lua/SimpleDBus/Bench'
+local IFACE = 'org.lua.SimpleDBus.Bench'
+
+-- representative arguments echoed by the server
+local function bytes(n)
+   local t = {}
+   for i = 1, n do
+      t[i] = i % 256
+   end
+   return t
+end
+
+-- the same few names over and over like the keys, interfaces
+-- and paths of real messages, and numbers to compare with
+local function names(n)
+   local keys = { 'Connected', 'RSSI', 'Name', 'Alias', 'Address',
+      'Paired', 'Trusted', 'UUIDs', 'ServicesResolved', 'Percentage' }
+   local t = {}
+   for i = 1, n do
+      t[i] = keys[i % #keys + 1]
+   end
+   return t
+end
+
+local function numbers(n)
+   local t = {}
+   for i = 1, n do
+      t[i] = i
+   end
+   return t
+end
+
+local function properties()
+   return {
+      Name = 'bench',
+      Address = '00:11:22:33:44:55',
+      Size = 4096,
+      Powered = true,
+      Discoverable = false,
+   }
+end
+
+local function objects(n)
+   local t = {}
+   for i = 1, n do
+      t[i] = {
+         ('%s/obj%d'):format(PATH, i),
+         {
+            [IFACE .. '.Device'] = properties(),
+            [IFACE .. '.Battery'] = { Percentage = 80, State = 'charging' },
+         }
+      }
+   end
+   return t
+end
+
+local payloads = {
+   { signature = 'a{sv}',         method = 'EchoDict',    value = properties() },
+   { signature = 'ay',            method = 'EchoBytes',   value = bytes(4096) },
+   { signature = 'as',            method = 'EchoNames',   value = names(200) },
+   { signature = 'au',            method = 'EchoNumbers', value = numbers(200) },
+   { signature = 'a(oa{sa{sv}})', method = 'EchoObjects', value = objects(20) },
+}
+
+local function server()
+   local bus = assert(DBus.SessionBus())
+   local methods = {
+      [IFACE .. '.Ping'] = { 'u', 'u', function(n) return n end },
+   }
+
+   for _, p in ipairs(payloads) do
+      methods[IFACE .. '.' .. p.method] =
+         { p.signature, p.signature, function(v) return v end }
+   end
+
+   assert(bus:register_object_path(PATH, methods))
+   assert(bus:request_name(NAME) == DBus.REQUEST_NAME_REPLY_PRIMARY_OWNER)
+   assert(DBus.mainloop(bus))
+end
+
+local function report(name, n, f)
+   local cpu, start = os.clock(), DBus.now()
+
+   f(n)
+
+   local seconds = DBus.now() - start
+   print(('{"name": "%s", "n": %d, "seconds": %.6f, "ops": %.1f, '
+      .. '"us": %.3f, "cpu": %.6f}'):format(
+      name, n, seconds, n / seconds, seconds * 1e6 / n, os.clock() - cpu))
+   io.stdout:flush()
+end
+
+-- wait in the main loop until n is returned by f
+local function wait(f, n)
+   while f() < n do
+      DBus.sleep(1)
+   end
+end
+
+-- marshalling and unmarshalling alone
+local function codec()
+   for _, p in ipairs(payloads) do
+      local data = assert(DBus.encode(p.signature, p.value))
+
+      report('encode ' .. p.signature, 2000, function(n)
+         for i = 1, n do
+            DBus.encode(p.signature, p.value)
+         end
+      end)
+
+      report('decode ' .. p.signature, 2000, function(n)
+         for i = 1, n do
+            DBus.decode(data)
+         end
+      end)
+   end
+end
+
+local function client()
+   local bus = assert(DBus.SessionBus())
+   local senders = {}
+   local conns = { bus }
+
+   for i = 1, 8 do
+      senders[i] = assert(DBus.SessionBus(true))
+      conns[i + 1] = senders[i]
+   end
+
+   local function call(method, signature, ...)
+      return assert(bus:call_method(NAME, PATH, IFACE, method, false,
+         signature, ...))
+   end
+
+   -- wait for the server
+   assert(DBus.mainloop(bus, function()
+      while not bus:call_method('org.freedesktop.DBus',
+            '/org/freedesktop/DBus', 'org.freedesktop.DBus',
+            'NameHasOwner', false, 's', NAME) do
+         DBus.sleep(10)
+      end
+      DBus.stop()
+   end))
+
+   -- blocking calls outside the main loop
+   report('call_sync', 5000, function(n)
+      for i = 1, n do
+         call('Ping', 'u', i)
+      end
+   end)
+
+   conns[#conns + 1] = function()
+      -- one call at a time from the main loop
+      report('call_async', 5000, function(n)
+         for i = 1, n do
+            call('Ping', 'u', i)
+         end
+      end)
+
+      -- many calls in flight to the exported method
+      report('method_throughput', 20000, function(n)
+         local workers, done = 16, 0
+
+         for w = 1, workers do
+            DBus.after(0, function()
+               for i = 1, n / workers do
+                  call('Ping', 'u', i)
+               end
+               done = done + 1
+            end)
+         end
+
+         wait(function() return done end, workers)
+      end)
+
+      -- signals from several connections to one
+      report('signal_fanin', 8 * 5000, function(n)
+         local got = 0
+
+         assert(bus:register_signal(PATH, IFACE, 'Tick',
+            function() got = got + 1 end))
+
+         for _, s in ipairs(senders) do
+            DBus.after(0, function()
+               for i = 1, n / #senders do
+                  assert(s:send_signal(PATH, IFACE, 'Tick', 'u', i))
+               end
+            end)
+         end
+
+         wait(function() return got end, n)
+         bus:unregister_signal(PATH, IFACE, 'Tick')
+      end)
+
+      -- the same signal from many objects
+      local paths = {}
+      for i = 1, 1000 do
+         paths[i] = ('%s/obj%d'):format(PATH, i)
+      end
+      local status = properties()
+
+      report('broadcast send_signal', #paths * 10, function(n)
+         for i = 1, n do
+            assert(bus:send_signal(paths[(i - 1) % #paths + 1], IFACE,
+               'Status', 'a{sv}', status))
+         end
+      end)
+
+      report('broadcast emit', #paths * 10, function(n)
+         local signal = assert(DBus.prepare_signal(IFACE, 'Status',
+            'a{sv}', status))
+
+         for i = 1, n / #paths do
+            assert(bus:emit(signal, paths))
+         end
+      end)
+
+      -- marshalling and unmarshalling of the arguments both ways,
+      -- compare with call_async and the encode and decode
+      -- results for the cost of the round trip
+      for _, p in ipairs(payloads) do
+         report('echo ' .. p.signature, 1000, function(n)
+            for i = 1, n do
+               call(p.method, p.signature, p.value)
+            end
+         end)
+      end
+
+      DBus.stop()
+   end
+   assert(DBus.mainloop(unpack(conns)))
+end
+
+if arg[1] == 'server' then
+   server()
+elseif arg[1] == 'client' then
+   client()
+elseif arg[1] == 'codec' then
+   codec()
+else
+   io.stderr:write('usage: bench.lua server|client|codec\n')
+   os.exit(1)
+end
+
+-- vi: syntax=lua ts=3 sw=3 et:
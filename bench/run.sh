@@ -0,0 +1,40 @@
+#!/bin/sh
+#
+# Run the benchmarks against a private dbus-daemon listening
+# on a socket in a temporary directory, using the core.so
+# and simpledbus.lua in the current directory.
+#
+# usage: bench/run.sh [lua interpreter]
+#
+set -e
+
+LUA=${1:-lua}
+BENCH=$(dirname "$0")
+DIR=$(mktemp -d)
+DAEMON=
+SERVER=
+
+cleanup() {
+	[ -n "$SERVER" ] && kill $SERVER 2>/dev/null
+	[ -n "$DAEMON" ] && kill $DAEMON 2>/dev/null
+	rm -rf "$DIR"
+}
+trap cleanup EXIT INT TERM
+
+mkdir "$DIR/simpledbus"
+cp core.so "$DIR/simpledbus/core.so"
+
+DAEMON=$(dbus-daemon --config-file="$BENCH/session.conf" \
+	--address="unix:path=$DIR/bus" --fork --print-pid)
+
+DBUS_SESSION_BUS_ADDRESS="unix:path=$DIR/bus"
+LUA_CPATH="$DIR/?.so;;"
+LUA_PATH="./?.lua;;"
+export DBUS_SESSION_BUS_ADDRESS LUA_CPATH LUA_PATH
+
+$LUA "$BENCH/bench.lua" codec
+
+$LUA "$BENCH/bench.lua" server &
+SERVER=$!
+
+$LUA "$BENCH/bench.lua" client
@@ -0,0 +1,126 @@
+/*
+ * SimpleDBus - Simple DBus bindings for Lua
+ * Copyright (C) 2008 Emil Renner Berthing <esmil@mailme.dk>
+ *
+ * SimpleDBus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * SimpleDBus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with SimpleDBus. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ALLINONE
+#define LUA_LIB
+#include <lua.h>
+#include <lauxlib.h>
+#include <dbus/dbus.h>
+
+#include "add.h"
+#include "push.h"
+
+#define EXPORT
+#endif
+
+/*
+ * Values are encoded in the wire format of a whole message,
+ * so they can be decoded without a bus, stored or forwarded.
+ * The message is a signal from a fixed object since it
+ * needs a valid header to be demarshalled again.
+ */
+#define CODEC_PATH      "/org/lua/SimpleDBus"
+#define CODEC_INTERFACE "org.lua.SimpleDBus"
+#define CODEC_MEMBER    "Payload"
+
+/*
+ * encode()
+ *
+ * argument 1: signature
+ * ...
+ *
+ * Returns a string with the arguments marshalled
+ * in a message with the given signature
+ */
+EXPORT int codec_encode(lua_State *L)
+{
+	const char *signature = luaL_checkstring(L, 1);
+	DBusMessage *msg;
+	char *data;
+	int len;
+
+	msg = dbus_message_new_signal(CODEC_PATH,
+			CODEC_INTERFACE, CODEC_MEMBER);
+	if (msg == NULL) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "Out of memory");
+		return 2;
+	}
+
+	if (*signature &&
+			add_arguments(L, 2, lua_gettop(L), signature, msg)) {
+		dbus_message_unref(msg);
+		return lua_error(L);
+	}
+
+	/* a message must have a serial to be valid */
+	dbus_message_set_serial(msg, 1);
+
+	if (!dbus_message_marshal(msg, &data, &len)) {
+		dbus_message_unref(msg);
+		lua_pushnil(L);
+		lua_pushliteral(L, "Error marshalling message");
+		return 2;
+	}
+	dbus_message_unref(msg);
+
+	lua_pushlstring(L, data, len);
+	dbus_free(data);
+	return 1;
+}
+
+/*
+ * decode()
+ *
+ * argument 1: string returned by encode()
+ *
+ * Returns the values encoded in the string
+ */
+EXPORT int codec_decode(lua_State *L)
+{
+	size_t len;
+	const char *data = luaL_checklstring(L, 1, &len);
+	DBusMessage *msg;
+	DBusError err;
+	int nargs;
+
+	/* libdbus reports short or broken messages as out of memory */
+	if (dbus_message_demarshal_bytes_needed(data, (int)len) != (int)len) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "Invalid message");
+		return 2;
+	}
+
+	dbus_error_init(&err);
+	msg = dbus_message_demarshal(data, (int)len, &err);
+	if (msg == NULL) {
+		lua_pushnil(L);
+		if (dbus_error_is_set(&err)) {
+			lua_pushstring(L, err.message);
+			dbus_error_free(&err);
+		} else
+			lua_pushliteral(L, "Error demarshalling message");
+		return 2;
+	}
+
+	lua_settop(L, 0);
+	nargs = push_arguments(L, msg);
+	dbus_message_unref(msg);
+
+	return nargs;
+}
@@ -0,0 +1,25 @@
+/*
+ * SimpleDBus - Simple DBus bindings for Lua
+ * Copyright (C) 2008 Emil Renner Berthing <esmil@mailme.dk>
+ *
+ * SimpleDBus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * SimpleDBus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with SimpleDBus. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CODEC_H
+#define _CODEC_H
+
+int codec_encode(lua_State *L);
+int codec_decode(lua_State *L);
+
+#endif
@@ -0,0 +1,38 @@
+#!/usr/bin/env lua
+
+-- import the module
+local DBus = require 'simpledbus'
+
+-- initialise and get a handle for the session bus
+local bus = assert(DBus.SessionBus())
+
+-- print a line every second
+local n = 0
+local ticker = DBus.every(1000, function()
+   n = n + 1
+   print(('tick %i'):format(n))
+end)
+
+-- stop ticking after 5.5 seconds
+DBus.after(5500, function()
+   print 'Stopping the ticker'
+   ticker:cancel()
+end)
+
+-- run the main loop, and from the function started in it
+-- sleep a bit between method calls without blocking the loop
+assert(DBus.mainloop(bus, function()
+   local DBusProxy = assert(bus:auto_proxy(
+      'org.freedesktop.DBus', '/org/freedesktop/DBus'))
+
+   for i = 1, 3 do
+      DBus.sleep(2000)
+      print(('%i connections to the session bus'):format(
+         #assert(DBusProxy:ListNames())))
+   end
+
+   DBus.sleep(1000)
+   DBus.stop()
+end))
+
+-- vi: syntax=lua ts=3 sw=3 et:
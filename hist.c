@@ -0,0 +1,97 @@
+/*
+ * SimpleDBus - Simple DBus bindings for Lua
+ * Copyright (C) 2008 Emil Renner Berthing <esmil@mailme.dk>
+ *
+ * SimpleDBus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * SimpleDBus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with SimpleDBus. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ALLINONE
+#include <string.h>
+
+#define EXPORT
+#endif
+
+#include "hist.h"
+
+EXPORT void hist_reset(struct hist *h)
+{
+	memset(h, 0, sizeof(struct hist));
+}
+
+static unsigned int hist_index(uint64_t v)
+{
+	unsigned int e;
+
+	if (v < HIST_SUB)
+		return (unsigned int)v;
+
+	if (v >= (uint64_t)1 << HIST_MAX_BITS)
+		v = ((uint64_t)1 << HIST_MAX_BITS) - 1;
+
+	/* position of the highest bit set */
+	e = 63 - __builtin_clzll(v);
+
+	return (e - HIST_SUB_BITS + 1) * HIST_SUB +
+		(unsigned int)((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/*
+ * The largest value counted in bucket i
+ */
+static uint64_t hist_upper(unsigned int i)
+{
+	unsigned int shift;
+
+	if (i < HIST_SUB)
+		return i;
+
+	shift = i / HIST_SUB - 1;
+	return (((uint64_t)(HIST_SUB + i % HIST_SUB) + 1) << shift) - 1;
+}
+
+EXPORT void hist_add(struct hist *h, uint64_t us)
+{
+	h->buckets[hist_index(us)]++;
+	if (h->count == 0 || us < h->min)
+		h->min = us;
+	if (us > h->max)
+		h->max = us;
+	h->count++;
+	h->sum += us;
+}
+
+/*
+ * The value below which a fraction p of the values fall,
+ * reported as the upper bound of its bucket, but never
+ * more than the largest value seen
+ */
+EXPORT uint64_t hist_percentile(const struct hist *h, double p)
+{
+	uint64_t rank = (uint64_t)(p * (double)h->count);
+	uint64_t seen = 0;
+	uint64_t v;
+	unsigned int i;
+
+	if (h->count == 0)
+		return 0;
+
+	for (i = 0; i < HIST_BUCKETS - 1; i++) {
+		seen += h->buckets[i];
+		if (seen > rank)
+			break;
+	}
+
+	v = hist_upper(i);
+	return v > h->max ? h->max : v;
+}
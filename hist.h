@@ -0,0 +1,50 @@
+/*
+ * SimpleDBus - Simple DBus bindings for Lua
+ * Copyright (C) 2008 Emil Renner Berthing <esmil@mailme.dk>
+ *
+ * SimpleDBus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * SimpleDBus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with SimpleDBus. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _HIST_H
+#define _HIST_H
+
+#include <stdint.h>
+
+/*
+ * Latency histograms in microseconds with log-linear buckets like
+ * HdrHistogram: each power of two is split into HIST_SUB buckets,
+ * so every value is counted with a relative error below 1/HIST_SUB
+ * while adding a value is just a few instructions. Values from
+ * 2^HIST_MAX_BITS us (about 19 hours) are counted in the last bucket.
+ */
+#define HIST_SUB_BITS 5
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 36
+#define HIST_BUCKETS  ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct hist {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+	uint64_t buckets[HIST_BUCKETS];
+};
+
+#ifndef ALLINONE
+void hist_reset(struct hist *h);
+void hist_add(struct hist *h, uint64_t us);
+uint64_t hist_percentile(const struct hist *h, double p);
+#endif
+
+#endif
@@ -0,0 +1,268 @@
+/*
+ * SimpleDBus - Simple DBus bindings for Lua
+ * Copyright (C) 2008 Emil Renner Berthing <esmil@mailme.dk>
+ *
+ * SimpleDBus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * SimpleDBus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with SimpleDBus. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ALLINONE
+#define _GNU_SOURCE
+#define LUA_LIB
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <lua.h>
+#include <lauxlib.h>
+
+#define EXPORT
+#endif
+
+/*
+ * Bulk data is passed as a memfd rather than copied through the
+ * bus. The sender copies its string into a sealed memfd and sends
+ * the fd with type 'h', and the receiver maps it read-only.
+ */
+typedef struct {
+	const char *data;
+	size_t len;
+} Mapping;
+
+static int memfd_error(lua_State *L, const char *what)
+{
+	lua_pushnil(L);
+	lua_pushfstring(L, "Error %s: %s", what, strerror(errno));
+	return 2;
+}
+
+/*
+ * memfd()
+ *
+ * argument 1: data
+ * argument 2: name (optional)
+ */
+EXPORT int memfd_new(lua_State *L)
+{
+	size_t len;
+	const char *data = luaL_checklstring(L, 1, &len);
+	const char *name = luaL_optstring(L, 2, "simpledbus");
+	int fd;
+
+	fd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0)
+		return memfd_error(L, "creating memfd");
+
+	if (ftruncate(fd, (off_t)len))
+		goto error;
+
+	/* copy the string straight into the pages of the memfd */
+	if (len > 0) {
+		void *p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+				MAP_SHARED, fd, 0);
+
+		if (p == MAP_FAILED)
+			goto error;
+
+		memcpy(p, data, len);
+		munmap(p, len);
+	}
+
+	/* seal it, so the receiver can map it without
+	 * worrying about it changing or shrinking */
+	if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW |
+				F_SEAL_WRITE | F_SEAL_SEAL))
+		goto error;
+
+	lua_pushnumber(L, (lua_Number)fd);
+	return 1;
+
+error:
+	lua_pushnil(L);
+	lua_pushfstring(L, "Error writing memfd: %s", strerror(errno));
+	close(fd);
+	return 2;
+}
+
+/*
+ * map_fd()
+ *
+ * upvalue 1: Mapping
+ *
+ * argument 1: file descriptor
+ *
+ * Only sealed memfds are mapped, as the sender could
+ * otherwise shrink the file and crash us with SIGBUS
+ * when the missing pages are read.
+ */
+EXPORT int memfd_map(lua_State *L)
+{
+	int fd = luaL_checkint(L, 1);
+	struct stat st;
+	Mapping *m;
+	int seals;
+
+	seals = fcntl(fd, F_GET_SEALS);
+	if (seals < 0 && errno != EINVAL)
+		return memfd_error(L, "mapping fd");
+	if (seals < 0 || (seals & (F_SEAL_SHRINK | F_SEAL_WRITE)) !=
+			(F_SEAL_SHRINK | F_SEAL_WRITE)) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "fd is not sealed");
+		return 2;
+	}
+
+	if (fstat(fd, &st))
+		return memfd_error(L, "mapping fd");
+
+	m = lua_newuserdata(L, sizeof(Mapping));
+	m->data = NULL;
+	m->len = 0;
+
+	/* set the metatable */
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_setmetatable(L, -2);
+
+	if (st.st_size > 0) {
+		void *p = mmap(NULL, (size_t)st.st_size, PROT_READ,
+				MAP_SHARED, fd, 0);
+
+		if (p == MAP_FAILED)
+			return memfd_error(L, "mapping fd");
+
+		m->data = p;
+		m->len = (size_t)st.st_size;
+	}
+
+	/* return the mapping */
+	return 1;
+}
+
+/*
+ * close_fd()
+ *
+ * argument 1: file descriptor
+ *
+ * Every fd received in a message must be closed with this
+ */
+EXPORT int memfd_close(lua_State *L)
+{
+	int fd = luaL_checkint(L, 1);
+
+	if (close(fd))
+		return memfd_error(L, "closing fd");
+
+	/* return true */
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static Mapping *mapping_check(lua_State *L, int index)
+{
+	int r;
+
+	if (lua_getmetatable(L, index) == 0)
+		luaL_argerror(L, index, "expected a mapping");
+
+	r = lua_equal(L, lua_upvalueindex(1), -1);
+	lua_pop(L, 1);
+	if (r == 0)
+		luaL_argerror(L, index, "expected a mapping");
+
+	return (Mapping *)lua_touserdata(L, index);
+}
+
+/*
+ * Mapping.__len()
+ *
+ * upvalue 1: Mapping
+ *
+ * argument 1: mapping
+ */
+EXPORT int mapping_len(lua_State *L)
+{
+	Mapping *m = mapping_check(L, 1);
+
+	lua_pushnumber(L, (lua_Number)m->len);
+	return 1;
+}
+
+/*
+ * Mapping:sub()
+ *
+ * upvalue 1: Mapping
+ *
+ * argument 1: mapping
+ * argument 2: start, like string.sub() (optional)
+ * argument 3: end, like string.sub() (optional)
+ */
+EXPORT int mapping_sub(lua_State *L)
+{
+	Mapping *m = mapping_check(L, 1);
+	lua_Number len = (lua_Number)m->len;
+	lua_Number i = luaL_optnumber(L, 2, 1);
+	lua_Number j = luaL_optnumber(L, 3, -1);
+
+	if (i < 0)
+		i += len + 1;
+	if (j < 0)
+		j += len + 1;
+	if (i < 1)
+		i = 1;
+	if (j > len)
+		j = len;
+
+	if (i > j)
+		lua_pushliteral(L, "");
+	else
+		lua_pushlstring(L, m->data + (size_t)i - 1,
+				(size_t)(j - i) + 1);
+	return 1;
+}
+
+/*
+ * Mapping:unmap()
+ *
+ * upvalue 1: Mapping
+ *
+ * argument 1: mapping
+ */
+EXPORT int mapping_unmap(lua_State *L)
+{
+	Mapping *m = mapping_check(L, 1);
+
+	if (m->data) {
+		munmap((void *)m->data, m->len);
+		m->data = NULL;
+		m->len = 0;
+	}
+
+	/* return true */
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/*
+ * Mapping.__gc()
+ */
+EXPORT int mapping_gc(lua_State *L)
+{
+	Mapping *m = lua_touserdata(L, 1);
+
+	if (m->data)
+		munmap((void *)m->data, m->len);
+
+	return 0;
+}
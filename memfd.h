@@ -0,0 +1,30 @@
+/*
+ * SimpleDBus - Simple DBus bindings for Lua
+ * Copyright (C) 2008 Emil Renner Berthing <esmil@mailme.dk>
+ *
+ * SimpleDBus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * SimpleDBus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with SimpleDBus. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MEMFD_H
+#define _MEMFD_H
+
+int memfd_new(lua_State *L);
+int memfd_map(lua_State *L);
+int memfd_close(lua_State *L);
+int mapping_len(lua_State *L);
+int mapping_sub(lua_State *L);
+int mapping_unmap(lua_State *L);
+int mapping_gc(lua_State *L);
+
+#endif
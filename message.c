@@ -0,0 +1,352 @@
+/*
+ * SimpleDBus - Simple DBus bindings for Lua
+ * Copyright (C) 2008 Emil Renner Berthing <esmil@mailme.dk>
+ *
+ * SimpleDBus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * SimpleDBus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with SimpleDBus. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ALLINONE
+#define LUA_LIB
+#include <lua.h>
+#include <lauxlib.h>
+#include <dbus/dbus.h>
+
+#include "push.h"
+
+#define EXPORT
+#endif
+
+/*
+ * A Message keeps a received message referenced, so its
+ * arguments can be read when they are needed instead of all
+ * being turned into Lua values up front.
+ */
+typedef struct {
+	DBusMessage *msg;
+} LMessage;
+
+/*
+ * A cursor walks the elements of an array in a message
+ */
+typedef struct {
+	DBusMessage *msg;
+	DBusMessageIter iter;
+	unsigned int i;
+} LCursor;
+
+/* registry key of the Message metatable */
+static char message_key;
+
+/*
+ * Remember the Message metatable at index for message_push()
+ */
+EXPORT void message_init(lua_State *L, int index)
+{
+	lua_pushlightuserdata(L, &message_key);
+	lua_pushvalue(L, index);
+	lua_rawset(L, LUA_REGISTRYINDEX);
+}
+
+/*
+ * Push a Message referencing msg. This is also used to
+ * unmarshal replies, so it doesn't rely on upvalues.
+ */
+EXPORT int message_push(lua_State *L, DBusMessage *msg)
+{
+	LMessage *m = lua_newuserdata(L, sizeof(LMessage));
+
+	m->msg = dbus_message_ref(msg);
+
+	lua_pushlightuserdata(L, &message_key);
+	lua_rawget(L, LUA_REGISTRYINDEX);
+	lua_setmetatable(L, -2);
+
+	return 1;
+}
+
+static LMessage *message_check(lua_State *L, int index)
+{
+	int r;
+
+	if (lua_getmetatable(L, index) == 0)
+		luaL_argerror(L, index, "expected a message");
+
+	r = lua_equal(L, lua_upvalueindex(1), -1);
+	lua_pop(L, 1);
+	if (r == 0)
+		luaL_argerror(L, index, "expected a message");
+
+	return (LMessage *)lua_touserdata(L, index);
+}
+
+/*
+ * Move iter to argument n of the message, returns 0
+ * if the message has fewer arguments
+ */
+static int message_arg(LMessage *m, int n, DBusMessageIter *iter)
+{
+	if (n < 1 || !dbus_message_iter_init(m->msg, iter))
+		return 0;
+
+	while (--n) {
+		if (!dbus_message_iter_next(iter))
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Message.__index()
+ *
+ * upvalue 1: Message
+ *
+ * argument 1: message
+ * argument 2: key
+ *
+ * Numbers decode that argument of the message,
+ * other keys look up the Message methods
+ */
+EXPORT int message_index(lua_State *L)
+{
+	LMessage *m = message_check(L, 1);
+	DBusMessageIter args;
+
+	if (lua_type(L, 2) != LUA_TNUMBER) {
+		lua_pushvalue(L, 2);
+		lua_rawget(L, lua_upvalueindex(1));
+		return 1;
+	}
+
+	if (!message_arg(m, (int)lua_tointeger(L, 2), &args))
+		return 0;
+
+	push_value(L, &args);
+	return 1;
+}
+
+/*
+ * Message.__len()
+ *
+ * upvalue 1: Message
+ *
+ * argument 1: message
+ *
+ * Returns the number of arguments
+ */
+EXPORT int message_len(lua_State *L)
+{
+	LMessage *m = message_check(L, 1);
+	DBusMessageIter args;
+	int n = 0;
+
+	if (dbus_message_iter_init(m->msg, &args)) {
+		do {
+			n++;
+		} while (dbus_message_iter_next(&args));
+	}
+
+	lua_pushnumber(L, (lua_Number)n);
+	return 1;
+}
+
+/*
+ * Message:unpack()
+ *
+ * upvalue 1: Message
+ *
+ * argument 1: message
+ *
+ * Returns all the arguments, like a handler
+ * would have been called with
+ */
+EXPORT int message_unpack(lua_State *L)
+{
+	LMessage *m = message_check(L, 1);
+
+	return push_arguments(L, m->msg);
+}
+
+/*
+ * Message:into()
+ *
+ * upvalue 1: Message
+ *
+ * argument 1: message
+ * argument 2: table for argument 1 (optional)
+ * ...
+ *
+ * Returns all the arguments like Message:unpack(), but
+ * arrays, dictionaries and structs are decoded into the
+ * tables given for them, reusing the tables inside them too
+ */
+EXPORT int message_into(lua_State *L)
+{
+	LMessage *m = message_check(L, 1);
+	int top = lua_gettop(L);
+	DBusMessageIter args;
+	int n = 0;
+
+	if (!dbus_message_iter_init(m->msg, &args))
+		return 0;
+
+	do {
+		n++;
+		luaL_checkstack(L, 1, "too many arguments");
+		if (n < top)
+			lua_pushvalue(L, n + 1);
+		else
+			lua_pushnil(L);
+		push_value_into(L, &args);
+	} while (dbus_message_iter_next(&args));
+
+	return n;
+}
+
+static int push_header(lua_State *L, const char *s)
+{
+	if (s == NULL)
+		return 0;
+
+	lua_pushstring(L, s);
+	return 1;
+}
+
+/*
+ * Message:signature(), Message:sender(), Message:path(),
+ * Message:interface() and Message:member()
+ *
+ * upvalue 1: Message
+ *
+ * argument 1: message
+ *
+ * Return the header field, or nil if the message doesn't have it
+ */
+EXPORT int message_signature(lua_State *L)
+{
+	return push_header(L,
+			dbus_message_get_signature(message_check(L, 1)->msg));
+}
+
+EXPORT int message_sender(lua_State *L)
+{
+	return push_header(L,
+			dbus_message_get_sender(message_check(L, 1)->msg));
+}
+
+EXPORT int message_path(lua_State *L)
+{
+	return push_header(L,
+			dbus_message_get_path(message_check(L, 1)->msg));
+}
+
+EXPORT int message_interface(lua_State *L)
+{
+	return push_header(L,
+			dbus_message_get_interface(message_check(L, 1)->msg));
+}
+
+EXPORT int message_member(lua_State *L)
+{
+	return push_header(L,
+			dbus_message_get_member(message_check(L, 1)->msg));
+}
+
+/*
+ * Iterator returned by Message:elements()
+ *
+ * upvalue 1: cursor
+ */
+static int cursor_next(lua_State *L)
+{
+	LCursor *c = lua_touserdata(L, lua_upvalueindex(1));
+	DBusMessageIter entry;
+
+	switch (dbus_message_iter_get_arg_type(&c->iter)) {
+	case DBUS_TYPE_INVALID:
+		return 0;
+	case DBUS_TYPE_DICT_ENTRY:
+		dbus_message_iter_recurse(&c->iter, &entry);
+		push_value(L, &entry);
+		dbus_message_iter_next(&entry);
+		push_value(L, &entry);
+		break;
+	default:
+		lua_pushnumber(L, (lua_Number)++c->i);
+		push_value(L, &c->iter);
+	}
+
+	dbus_message_iter_next(&c->iter);
+	return 2;
+}
+
+/*
+ * Message:elements()
+ *
+ * upvalue 1: Message
+ * upvalue 2: Cursor
+ *
+ * argument 1: message
+ * argument 2: argument number (optional)
+ *
+ * Returns an iterator decoding one element of the array at
+ * a time. Arrays of dictionary entries give each key and
+ * value like pairs(), other arrays the index and value like
+ * ipairs().
+ */
+EXPORT int message_elements(lua_State *L)
+{
+	LMessage *m = message_check(L, 1);
+	int n = luaL_optint(L, 2, 1);
+	DBusMessageIter args;
+	LCursor *c;
+
+	if (!message_arg(m, n, &args) ||
+			dbus_message_iter_get_arg_type(&args)
+			!= DBUS_TYPE_ARRAY)
+		return luaL_argerror(L, 2, "not an array");
+
+	c = lua_newuserdata(L, sizeof(LCursor));
+	c->msg = dbus_message_ref(m->msg);
+	dbus_message_iter_recurse(&args, &c->iter);
+	c->i = 0;
+
+	lua_pushvalue(L, lua_upvalueindex(2));
+	lua_setmetatable(L, -2);
+
+	lua_pushcclosure(L, cursor_next, 1);
+	return 1;
+}
+
+/*
+ * Message.__gc()
+ */
+EXPORT int message_gc(lua_State *L)
+{
+	LMessage *m = lua_touserdata(L, 1);
+
+	dbus_message_unref(m->msg);
+	return 0;
+}
+
+/*
+ * Cursor.__gc()
+ */
+EXPORT int cursor_gc(lua_State *L)
+{
+	LCursor *c = lua_touserdata(L, 1);
+
+	dbus_message_unref(c->msg);
+	return 0;
+}
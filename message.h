@@ -0,0 +1,37 @@
+/*
+ * SimpleDBus - Simple DBus bindings for Lua
+ * Copyright (C) 2008 Emil Renner Berthing <esmil@mailme.dk>
+ *
+ * SimpleDBus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * SimpleDBus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with SimpleDBus. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MESSAGE_H
+#define _MESSAGE_H
+
+void message_init(lua_State *L, int index);
+int message_push(lua_State *L, DBusMessage *msg);
+int message_index(lua_State *L);
+int message_len(lua_State *L);
+int message_unpack(lua_State *L);
+int message_into(lua_State *L);
+int message_signature(lua_State *L);
+int message_sender(lua_State *L);
+int message_path(lua_State *L);
+int message_interface(lua_State *L);
+int message_member(lua_State *L);
+int message_elements(lua_State *L);
+int message_gc(lua_State *L);
+int cursor_gc(lua_State *L);
+
+#endif
@@ -19,6 +19,8 @@
 #ifndef _PUSH_H
 #define _PUSH_H
 
+void push_value(lua_State *L, DBusMessageIter *args);
+void push_value_into(lua_State *L, DBusMessageIter *args);
 int push_arguments(lua_State *L, DBusMessage *msg);
 
 #endif
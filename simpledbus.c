@@ -16,40 +16,58 @@
  * along with SimpleDBus. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdarg.h>
 #include <errno.h>
 #include <string.h>
 #include <stdio.h>
-#include <poll.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
 
 #define LUA_LIB
 #include <lua.h>
 #include <lauxlib.h>
 #include <dbus/dbus.h>
 
+#include "simpledbus.h"
+
 #ifdef ALLINONE
 #include <expat.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #define EXPORT static
 
 #include "add.c"
 #include "push.c"
 #include "parse.c"
+#include "timer.c"
+#include "hist.c"
+#include "memfd.c"
+#include "codec.c"
+#include "message.c"
 
 #else /* ALLINONE */
 
 #include "add.h"
 #include "push.h"
 #include "parse.h"
+#include "timer.h"
+#include "hist.h"
+#include "memfd.h"
+#include "codec.h"
+#include "message.h"
 
 #endif /* ALLINONE */
 
-static DBusError err;
-static DBusObjectPathVTable vtable;
-static lua_State *mainThread = NULL;
-static int stop;
-
 #ifdef DEBUG
 static void dump_watch(DBusWatch *watch)
 {
@@ -74,100 +92,380 @@ static void dump_watch(DBusWatch *watch)
 }
 #endif
 
-typedef struct {
+/*
+ * Everything registered in the epoll set starts with
+ * a struct source telling what to call when it's ready
+ */
+struct source {
+	void (*ready)(struct source *s, uint32_t events);
+};
+
+/*
+ * Method calls waiting for a reply are kept in a list
+ * per connection, so they can be cancelled
+ */
+struct call {
+	struct call *next;
+	struct call **pprev;
+	struct lcon *c;
+	DBusPendingCall *pending;
+	lua_State *T;
+	simpledbus_unmarshal unmarshal; /* pushes the results */
+	struct hist *hist;      /* latency histogram of the method */
+	uint64_t start;         /* when the call was sent */
+};
+
+/*
+ * The thread running a method holds this at index 2 until
+ * the reply is sent. If the thread errors or is never resumed,
+ * request_gc() releases the connection and the message.
+ */
+struct request {
 	DBusConnection *conn;
+	DBusMessage *msg;       /* the method call */
+	struct hist *hist;      /* latency histogram of the method */
+	uint64_t start;         /* when the call was received */
+};
+
+/* messages dispatched per connection per loop iteration */
+#define DEFAULT_BUDGET 64
+
+/*
+ * Counters kept per connection for Bus:stats(),
+ * messages are counted by their type
+ */
+struct stats {
+	uint64_t sent[DBUS_NUM_MESSAGE_TYPES];
+	uint64_t received[DBUS_NUM_MESSAGE_TYPES];
+	uint64_t signals_matched;
+	uint64_t signals_unmatched;
+	uint64_t methods_served;
+};
+
+/*
+ * The watches of a connection or server are kept in a dense array.
+ * Enabled watches are kept in front, so the active ones are
+ * watches[0] .. watches[nactive-1]. The index of each watch is
+ * found in a small hash table keyed by the watch pointer, which
+ * leaves the data of the watch alone. This makes adding, removing
+ * and toggling watches O(1).
+ */
+struct watchset {
+	struct source s;
+	simpledbus_loop *loop;
 	unsigned int watches_changed;
 	unsigned int nactive;
-	DBusWatch *active;
+	unsigned int nwatches;
+	unsigned int size;
+	DBusWatch **watches;
+	unsigned int *slots;    /* index+1 of the watches, 0 for empty */
+	unsigned int nslots;    /* twice size, a power of 2 */
+	unsigned int attached;  /* number of times attached to the loop */
+};
+
+typedef struct lcon {
+	struct watchset w;
+	DBusConnection *conn;
+	lua_State *S;           /* signal thread with the signal table */
+	unsigned int index;     /* index in the loop's connections */
+	int anchored;           /* attached for good by get_fd() */
+	int disconnected;       /* got the Disconnected signal */
+	int installed;          /* hooked up by connection_install() */
+	int private;            /* opened privately, so close it when done */
+	int bus_type;           /* bus connected to or -1 */
+	char *address;          /* ..or the address opened */
+	int reconnect;          /* call the reconnect function when disconnected */
+	int priority;           /* dispatched before lower priorities */
+	unsigned int budget;    /* messages per iteration, 0 for no limit */
+	uint64_t ready_at;      /* when undispatched messages were read */
+	struct hist latency;    /* dispatch latencies */
+	lua_State *H;           /* thread with the call and method histograms */
+	struct call *calls;     /* calls waiting for a reply */
+	unsigned int ncalls;
+	struct stats stats;
 } LCon;
 
-static dbus_bool_t watch_list_insert(LCon *c, DBusWatch *watch)
+/*
+ * Work posted to the loop from other threads
+ */
+struct post {
+	struct post *next;
+	lua_CFunction func;
+	void *data;
+};
+
+/*
+ * The state of the main loop. There is one per Lua state, kept in
+ * its registry, so independent Lua states can run their own loops
+ * in different threads as long as they don't share connections.
+ */
+struct simpledbus_loop {
+	lua_State *mainThread;  /* thread running the loop or NULL */
+	int stop;
+	int epfd;
+	struct epoll_event *batch; /* events being handled */
+	int batch_n;
+	struct timer_wheel wheel;
+	lua_State *callbacks;
+	LCon **conns;           /* connections attached to the loop */
+	unsigned int nconns;
+	unsigned int conns_size;
+	unsigned int round;     /* dispatch round, for round-robin */
+	int dispatching;        /* in dispatchall(), so don't move conns */
+	int resort;             /* ..but sort them when it's done */
+	unsigned int disconnects; /* connections seen disconnecting */
+	uint64_t iterations;    /* times the loop polled */
+	uint64_t wakeups;       /* ..and found something ready */
+	struct source wake;     /* eventfd woken by other threads */
+	int wakefd;
+	struct post *posts;     /* stack of posted work, newest first */
+	int stop_requested;
+	int draining;           /* wait for calls before stopping */
+	uint64_t deadline;      /* ..but no longer than this */
+	struct source sig;      /* signalfd for the handled signals */
+	int sigfd;
+	sigset_t sigmask;
+	sigset_t sigblocked;    /* handled, but blocked before that */
+	struct fdmux **fdmux;   /* watched file descriptors by number */
+	int fdmux_size;
+	unsigned int users;     /* connections and servers polled by it */
+	int closed;             /* collected, but still in use */
+};
+
+#define loop_of(s, member) \
+	((simpledbus_loop *)((char *)(s) - offsetof(simpledbus_loop, member)))
+
+/* registry keys, only their addresses matter */
+static char loop_key;
+static char callbacks_key;
+static char signals_key;
+static char bus_key;
+static char request_key;
+
+/* connection data slot pointing back to the LCon */
+static dbus_int32_t lcon_slot = -1;
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static simpledbus_loop *loop_get(lua_State *L)
+{
+	simpledbus_loop *l;
+
+	lua_pushlightuserdata(L, &loop_key);
+	lua_rawget(L, LUA_REGISTRYINDEX);
+	l = lua_touserdata(L, -1);
+	lua_pop(L, 1);
+
+	return l;
+}
+
+static inline unsigned int watch_hash(const struct watchset *ws,
+		DBusWatch *watch)
+{
+	return (unsigned int)(((uintptr_t)watch >> 4) * 2654435761u) &
+		(ws->nslots - 1);
+}
+
+/*
+ * Return the slot holding the index of a watch in the set
+ */
+static unsigned int *watch_slot(struct watchset *ws, DBusWatch *watch)
+{
+	unsigned int h = watch_hash(ws, watch);
+
+	while (ws->watches[ws->slots[h] - 1] != watch)
+		h = (h + 1) & (ws->nslots - 1);
+
+	return &ws->slots[h];
+}
+
+#define watch_index(ws, watch) (*watch_slot(ws, watch) - 1)
+
+static void watch_slot_add(struct watchset *ws, unsigned int i)
+{
+	unsigned int h = watch_hash(ws, ws->watches[i]);
+
+	while (ws->slots[h])
+		h = (h + 1) & (ws->nslots - 1);
+
+	ws->slots[h] = i + 1;
+}
+
+/*
+ * Empty the slot and move the ones after it back,
+ * so lookups of them don't stop at the hole
+ */
+static void watch_slot_remove(struct watchset *ws, unsigned int *slot)
 {
-	DBusWatch *prev, *next;
+	unsigned int mask = ws->nslots - 1;
+	unsigned int i = slot - ws->slots;
+	unsigned int j = i;
+
+	for (;;) {
+		unsigned int h;
+
+		j = (j + 1) & mask;
+		if (ws->slots[j] == 0)
+			break;
 
-	if (c->active == NULL) {
-		c->active = watch;
-		dbus_watch_set_data(watch, NULL, NULL);
-		c->nactive++;
-		c->watches_changed = 1;
-		return TRUE;
+		/* leave it if it's where lookups starting at h find it */
+		h = watch_hash(ws, ws->watches[ws->slots[j] - 1]);
+		if (i <= j ? (i < h && h <= j) : (i < h || h <= j))
+			continue;
+
+		ws->slots[i] = ws->slots[j];
+		i = j;
 	}
 
-	next = c->active;
-	while (next != watch) {
-		prev = next;
-		next = dbus_watch_get_data(prev);
+	ws->slots[i] = 0;
+}
 
-		if (next == NULL) { /* list ended */
-			dbus_watch_set_data(prev, watch, NULL);
-			dbus_watch_set_data(watch, NULL, NULL);
-			c->nactive++;
-			c->watches_changed = 1;
-			return TRUE;
-		}
+static inline void watch_swap(struct watchset *ws, unsigned int i, unsigned int j)
+{
+	unsigned int *si = watch_slot(ws, ws->watches[i]);
+	unsigned int *sj = watch_slot(ws, ws->watches[j]);
+	DBusWatch *watch = ws->watches[i];
+
+	ws->watches[i] = ws->watches[j];
+	ws->watches[j] = watch;
+	*si = j + 1;
+	*sj = i + 1;
+}
+
+/*
+ * Recalculate the events we're interested in for fd from the
+ * active watches and update the epoll set accordingly.
+ * Only watch sets attached to the loop are polled.
+ */
+static void watch_update(struct watchset *ws, int fd)
+{
+	struct epoll_event ev;
+	DBusWatch **watch;
+	DBusWatch **end = ws->watches + ws->nactive;
+
+	if (!ws->attached)
+		return;
+
+	ev.events = 0;
+	ev.data.ptr = &ws->s;
+
+	for (watch = ws->watches; watch < end; watch++) {
+		unsigned int flags;
+
+		if (dbus_watch_get_unix_fd(*watch) != fd)
+			continue;
+
+		flags = dbus_watch_get_flags(*watch);
+		if (flags & DBUS_WATCH_READABLE)
+			ev.events |= EPOLLIN;
+		if (flags & DBUS_WATCH_WRITABLE)
+			ev.events |= EPOLLOUT;
 	}
 
-	/* Hmm.. watch was already in
-	 * the list of active watches */
-	return TRUE;
+	if (ev.events == 0) {
+		/* the fd might already be closed, so ignore errors */
+		(void)epoll_ctl(ws->loop->epfd, EPOLL_CTL_DEL, fd, &ev);
+		return;
+	}
+
+	if (epoll_ctl(ws->loop->epfd, EPOLL_CTL_MOD, fd, &ev)
+			&& errno == ENOENT)
+		(void)epoll_ctl(ws->loop->epfd, EPOLL_CTL_ADD, fd, &ev);
 }
 
-static dbus_bool_t add_watch_cb(DBusWatch *watch, LCon *c)
+static void watch_activate(struct watchset *ws, DBusWatch *watch)
 {
-#ifdef DEBUG
-	printf("Add watch: ");
-	dump_watch(watch);
-	fflush(stdout);
-#endif
-	if (dbus_watch_get_enabled(watch) == FALSE)
-		return TRUE;
+	unsigned int i = watch_index(ws, watch);
+
+	if (i < ws->nactive) /* already active */
+		return;
 
-	return watch_list_insert(c, watch);
+	watch_swap(ws, i, ws->nactive);
+	ws->nactive++;
+	ws->watches_changed++;
+	watch_update(ws, dbus_watch_get_unix_fd(watch));
 }
 
-static void watch_list_remove(LCon *c, DBusWatch *watch)
+static void watch_deactivate(struct watchset *ws, DBusWatch *watch)
 {
-	DBusWatch *prev, *next;
+	unsigned int i = watch_index(ws, watch);
 
-	if (watch == c->active) {
-		c->active = dbus_watch_get_data(watch);
-		dbus_watch_set_data(watch, NULL, NULL);
-		c->nactive--;
-		c->watches_changed = 1;
+	if (i >= ws->nactive) /* not active */
 		return;
-	}
 
-	next = c->active;
-	while (next) {
-		prev = next;
-		next = dbus_watch_get_data(prev);
+	ws->nactive--;
+	watch_swap(ws, i, ws->nactive);
+	ws->watches_changed++;
+	watch_update(ws, dbus_watch_get_unix_fd(watch));
+}
 
-		if (watch == next) {
-			dbus_watch_set_data(prev,
-					dbus_watch_get_data(watch), NULL);
-			dbus_watch_set_data(watch, NULL, NULL);
-			c->nactive--;
-			c->watches_changed = 1;
-			return;
-		}
+static dbus_bool_t add_watch_cb(DBusWatch *watch, struct watchset *ws)
+{
+#ifdef DEBUG
+	printf("Add watch: ");
+	dump_watch(watch);
+	fflush(stdout);
+#endif
+	if (ws->nwatches == ws->size) {
+		unsigned int size = ws->size ? 2*ws->size : 4;
+		DBusWatch **watches = realloc(ws->watches,
+				size * sizeof(DBusWatch *));
+		unsigned int *slots;
+		unsigned int i;
+
+		if (watches == NULL)
+			return FALSE;
+		ws->watches = watches;
+
+		slots = calloc(2*size, sizeof(unsigned int));
+		if (slots == NULL)
+			return FALSE;
+
+		/* move the indices to the bigger table */
+		free(ws->slots);
+		ws->slots = slots;
+		ws->nslots = 2*size;
+		for (i = 0; i < ws->nwatches; i++)
+			watch_slot_add(ws, i);
+
+		ws->size = size;
 	}
-	/* Watch wasn't found */
+
+	ws->watches[ws->nwatches] = watch;
+	watch_slot_add(ws, ws->nwatches);
+	ws->nwatches++;
+
+	if (dbus_watch_get_enabled(watch))
+		watch_activate(ws, watch);
+
+	return TRUE;
 }
 
-static void remove_watch_cb(DBusWatch *watch, LCon *c)
+static void remove_watch_cb(DBusWatch *watch, struct watchset *ws)
 {
+	unsigned int i;
+
 #ifdef DEBUG
 	printf("Remove watch: ");
 	dump_watch(watch);
 	fflush(stdout);
 #endif
-	if (dbus_watch_get_enabled(watch) == FALSE)
-		return;
+	watch_deactivate(ws, watch);
 
-	watch_list_remove(c, watch);
+	i = watch_index(ws, watch);
+	ws->nwatches--;
+	if (i != ws->nwatches)
+		watch_swap(ws, i, ws->nwatches);
+	watch_slot_remove(ws, watch_slot(ws, watch));
 }
 
-static void toggle_watch_cb(DBusWatch *watch, LCon *c)
+static void toggle_watch_cb(DBusWatch *watch, struct watchset *ws)
 {
 #ifdef DEBUG
 	printf("Toggle watch: ");
@@ -175,83 +473,167 @@ static void toggle_watch_cb(DBusWatch *watch, LCon *c)
 	fflush(stdout);
 #endif
 	if (dbus_watch_get_enabled(watch))
-		(void)watch_list_insert(c, watch);
+		watch_activate(ws, watch);
 	else
-		watch_list_remove(c, watch);
+		watch_deactivate(ws, watch);
 }
 
-static LCon *bus_check(lua_State *L, int index)
+static void watchset_init(struct watchset *ws, simpledbus_loop *l,
+		void (*ready)(struct source *s, uint32_t events))
 {
-	int r;
+	ws->s.ready = ready;
+	ws->loop = l;
+	ws->watches_changed = 0;
+	ws->nactive = 0;
+	ws->nwatches = 0;
+	ws->size = 0;
+	ws->watches = NULL;
+	ws->slots = NULL;
+	ws->nslots = 0;
+	ws->attached = 0;
+	l->users++;
+}
 
-	if (lua_getmetatable(L, index) == 0)
-		luaL_argerror(L, index,
-				"expected a DBus connection");
+/*
+ * Close the file descriptors of the loop and free its state
+ */
+static void loop_free(simpledbus_loop *l)
+{
+	struct post *p;
+
+	if (l->sigfd >= 0)
+		close(l->sigfd);
+	if (l->wakefd >= 0)
+		close(l->wakefd);
+	if (l->epfd >= 0)
+		close(l->epfd);
+	l->sigfd = -1;
+	l->wakefd = -1;
+	l->epfd = -1;
+
+	/* the state is going away, so forget about posted work */
+	p = __sync_lock_test_and_set(&l->posts, NULL);
+	while (p) {
+		struct post *next = p->next;
+
+		free(p);
+		p = next;
+	}
 
-	r = lua_equal(L, lua_upvalueindex(1), -1);
-	lua_pop(L, 1);
-	if (r == 0)
-		luaL_argerror(L, index,
-				"expected a DBus connection");
+	free(l->conns);
+	l->conns = NULL;
+	l->nconns = 0;
+	l->conns_size = 0;
 
-	return (LCon *)lua_touserdata(L, index);
+	while (l->fdmux_size > 0)
+		free(l->fdmux[--l->fdmux_size]);
+	free(l->fdmux);
+	l->fdmux = NULL;
 }
 
 /*
- * Bus:get_signal_table()
- *
- * argument 1: bus
+ * Free the watches of a connection or server that is being
+ * collected. When the Lua state is closed the loop may be
+ * collected before them, so the last one frees the loop.
  */
-static int bus_get_signal_table(lua_State *L)
+static void watchset_free(struct watchset *ws)
 {
-	(void)bus_check(L, 1);
+	simpledbus_loop *l = ws->loop;
 
-	lua_getfenv(L, 1);
-	lua_rawgeti(L, 2, 2);
+	free(ws->watches);
+	ws->watches = NULL;
+	free(ws->slots);
+	ws->slots = NULL;
 
-	return 1;
+	if (--l->users == 0 && l->closed)
+		loop_free(l);
 }
 
-static void method_return_handler(DBusPendingCall *pending, lua_State *T)
+/*
+ * Start and stop polling the active watches. The caller
+ * keeps track of the number of attachments.
+ */
+static void watchset_poll(struct watchset *ws)
 {
-	DBusMessage *msg = dbus_pending_call_steal_reply(pending);
-	int nargs;
+	unsigned int i;
 
-	dbus_pending_call_unref(pending);
+	for (i = 0; i < ws->nactive; i++)
+		watch_update(ws, dbus_watch_get_unix_fd(ws->watches[i]));
+}
 
-	/* remove the thread from the threads table */
-	lua_pushthread(T);
-	lua_pushnil(T);
-	lua_rawset(T, -3);
-	/* pop threads table from the thread */
-	lua_pop(T, 1);
+static void watchset_unpoll(struct watchset *ws)
+{
+	struct epoll_event ev;
+	unsigned int i;
 
-	if (msg == NULL) {
-		lua_pushnil(T);
-		lua_pushliteral(T, "Reply null");
-		nargs = 2;
-	} else {
-		switch (dbus_message_get_type(msg)) {
-		case DBUS_MESSAGE_TYPE_METHOD_RETURN:
-			nargs = push_arguments(T, msg);
-			dbus_message_unref(msg);
-			break;
-		case DBUS_MESSAGE_TYPE_ERROR:
-			lua_pushnil(T);
-			dbus_set_error_from_message(&err, msg);
-			lua_pushstring(T, err.message);
-			dbus_error_free(&err);
-			dbus_message_unref(msg);
-			nargs = 2;
+	for (i = 0; i < ws->nactive; i++)
+		(void)epoll_ctl(ws->loop->epfd, EPOLL_CTL_DEL,
+				dbus_watch_get_unix_fd(ws->watches[i]), &ev);
+}
+
+/*
+ * Handle the watches of a ready file descriptor
+ * and return the flags they were handled with.
+ */
+static unsigned int watchset_handle(struct watchset *ws, uint32_t events)
+{
+	unsigned int changed = ws->watches_changed;
+	unsigned int flags = 0;
+	unsigned int i;
+
+	if (events & EPOLLIN)
+		flags |= DBUS_WATCH_READABLE;
+	if (events & EPOLLOUT)
+		flags |= DBUS_WATCH_WRITABLE;
+	if (events & EPOLLERR)
+		flags |= DBUS_WATCH_ERROR;
+	if (events & EPOLLHUP)
+		flags |= DBUS_WATCH_HANGUP;
+
+	for (i = 0; i < ws->nactive; i++) {
+		DBusWatch *watch = ws->watches[i];
+
+		if (!(dbus_watch_get_flags(watch) & flags) &&
+				!(flags & (DBUS_WATCH_ERROR|DBUS_WATCH_HANGUP)))
+			continue;
+
+		(void)dbus_watch_handle(watch, flags);
+
+		/* if handling the watch changed the set of active
+		 * watches we bail out, epoll will tell us again
+		 * about anything we didn't get to */
+		if (ws->watches_changed != changed)
 			break;
-		default:
-			dbus_message_unref(msg);
-			lua_pushnil(T);
-			lua_pushliteral(T, "Unknown reply");
-			nargs = 2;
-		}
 	}
 
+	return flags;
+}
+
+/*
+ * Move the error message on top of T to the thread running
+ * the main loop and stop it, unless it's stopping already
+ */
+static void loop_error(lua_State *T)
+{
+	simpledbus_loop *l;
+
+	/* T may be dead, so make sure we have room to work */
+	lua_checkstack(T, 2);
+	l = loop_get(T);
+
+	if (l->stop == 0) {
+		lua_xmove(T, l->mainThread, 1);
+		l->stop = -1;
+	}
+}
+
+/*
+ * Resume a suspended thread. If it finishes and was started
+ * by method_call_handler(), send the reply. Errors are moved
+ * to the main thread and stop the main loop.
+ */
+static void thread_resume(lua_State *T, int nargs)
+{
 	switch (lua_resume(T, nargs)) {
 	case 0: /* thread finished */
 #ifdef DEBUG
@@ -260,909 +642,3800 @@ static void method_return_handler(DBusPendingCall *pending, lua_State *T)
 				lua_gettop(T),
 				lua_typename(T, lua_type(T, 1)));
 #endif
-		if (lua_iscfunction(T, 1) && lua_tocfunction(T, 1)(T)
-				&& stop == 0) {
-			/* move error message to main thread */
-			lua_xmove(T, mainThread, 1);
-			stop = -1;
-		}
+		if (lua_iscfunction(T, 1) && lua_tocfunction(T, 1)(T))
+			loop_error(T);
 	case LUA_YIELD: /* thread yielded again */
 		break;
 	default:
-		if (stop == 0) {
-			/* move error message to main */
-			lua_xmove(T, mainThread, 1);
-			stop = -1;
-		}
+		loop_error(T);
 	}
 }
 
 /*
- * Bus:call_method()
- *
- * argument 1: bus
- * argument 2: target
- * argument 3: object
- * argument 4: interface
- * argument 5: method
- * argument 6: no reply
- * argument 7: signature (optional)
- * ...
+ * libdbus timeouts are kept in the timer wheel
+ * next to the timers created from Lua
  */
-static int bus_call_method(lua_State *L)
+typedef struct {
+	struct timer t;
+	simpledbus_loop *loop;
+	DBusTimeout *timeout;
+} LTimeout;
+
+static void timeout_expired(struct timer *t)
 {
-	LCon *c = bus_check(L, 1);
-	const char *interface;
-	DBusMessage *msg;
-	DBusMessage *ret;
+	LTimeout *lt = (LTimeout *)t;
 
-#ifdef DEBUG
-	printf("Calling:\n  %s\n  %s\n  %s\n  %s\n  %s\n",
-				lua_tostring(L, 2),
-				lua_tostring(L, 3),
-				lua_tostring(L, 4),
-				lua_tostring(L, 5),
-				lua_tostring(L, 7));
-	fflush(stdout);
-#endif
+	/* libdbus timeouts fire every interval until they're
+	 * disabled, so rearm before handling the timeout as
+	 * that might remove it */
+	timer_add(&lt->loop->wheel, t, timer_now() +
+			dbus_timeout_get_interval(lt->timeout));
 
-	/* create a new method call and check for errors */
-	interface = lua_tostring(L, 4);
-	if (interface && *interface == '\0')
-		interface = NULL;
+	(void)dbus_timeout_handle(lt->timeout);
+}
 
-	msg = dbus_message_new_method_call(
-				lua_tostring(L, 2),
-				lua_tostring(L, 3),
-				interface,
-				lua_tostring(L, 5));
-	if (msg == NULL) {
-		lua_pushnil(L);
-		lua_pushliteral(L, "Out of memory");
-		return 2;
-	}
+static dbus_bool_t add_timeout_cb(DBusTimeout *timeout, simpledbus_loop *l)
+{
+	LTimeout *lt = malloc(sizeof(LTimeout));
 
-	/* get the signature and add arguments */
-	if (lua_isstring(L, 7)) {
-		const char *signature = lua_tostring(L, 7);
-		if (*signature &&
-				add_arguments(L, 8, lua_gettop(L), signature, msg))
-			return lua_error(L);
-	}
+	if (lt == NULL)
+		return FALSE;
 
-        if (lua_toboolean(L, 6)) {
-            ret = dbus_connection_send(c->conn, msg, NULL);
-            dbus_message_unref(msg);
+	timer_init(&lt->t, timeout_expired);
+	lt->loop = l;
+	lt->timeout = timeout;
+	dbus_timeout_set_data(timeout, lt, free);
 
-            if (ret == FALSE) {
-                    lua_pushnil(L);
-                    lua_pushliteral(L, "Out of memory");
-                    return 2;
-            }
+	if (dbus_timeout_get_enabled(timeout))
+		timer_add(&l->wheel, &lt->t, timer_now() +
+				dbus_timeout_get_interval(timeout));
 
-            /* return true */
-            lua_pushboolean(L, 1);
-            return 1;
-        }
+	return TRUE;
+}
 
-	/* if (!lua_pushthread(L)) { / * L can be yielded */
-	if (mainThread) { /* main loop is running */
-		DBusPendingCall *pending;
+static void remove_timeout_cb(DBusTimeout *timeout, simpledbus_loop *l)
+{
+	LTimeout *lt = dbus_timeout_get_data(timeout);
 
-		if (!dbus_connection_send_with_reply(c->conn, msg, &pending, -1)) {
-			lua_pushnil(L);
-			lua_pushliteral(L, "Out of memory");
-			return 2;
-		}
+	if (lt)
+		timer_del(&l->wheel, &lt->t);
+}
 
-		if (!dbus_pending_call_set_notify(pending,
-					(DBusPendingCallNotifyFunction)
-					method_return_handler, L, NULL)) {
-			lua_pushnil(L);
-			lua_pushliteral(L, "Out of memory");
-			return 2;
-		}
+static void toggle_timeout_cb(DBusTimeout *timeout, simpledbus_loop *l)
+{
+	LTimeout *lt = dbus_timeout_get_data(timeout);
 
-		/* get the threads table */
-		lua_settop(L, 1);
-		lua_getfenv(L, 1);
-		/* save the thread there */
+	if (dbus_timeout_get_enabled(timeout))
+		timer_add(&l->wheel, &lt->t, timer_now() +
+				dbus_timeout_get_interval(timeout));
+	else
+		timer_del(&l->wheel, &lt->t);
+}
+
+/*
+ * Pending timers and watched file descriptors are userdata anchored
+ * in the callback table, indexed by their address, and the function
+ * to call or the thread to resume is stored under the userdata.
+ * The callback table is kept at index 1 on the stack of the
+ * callbacks thread, which is also used to start the callbacks in.
+ */
+static void anchor(lua_State *L, int table, int index, int value)
+{
+	lua_pushlightuserdata(L, lua_touserdata(L, index));
+	lua_pushvalue(L, index);
+	lua_rawset(L, table);
+	lua_pushvalue(L, index);
+	lua_pushvalue(L, value);
+	lua_rawset(L, table);
+}
+
+static void unanchor(lua_State *L, int table, int index)
+{
+	lua_pushlightuserdata(L, lua_touserdata(L, index));
+	lua_pushnil(L);
+	lua_rawset(L, table);
+	lua_pushvalue(L, index);
+	lua_pushnil(L);
+	lua_rawset(L, table);
+}
+
+/*
+ * Push the userdata anchored at p and its
+ * function or thread on the callbacks thread
+ */
+static lua_State *callback_get(simpledbus_loop *l, void *p)
+{
+	lua_State *S = l->callbacks;
+
+	lua_pushlightuserdata(S, p);
+	lua_rawget(S, 1);
+	lua_pushvalue(S, 2);
+	lua_rawget(S, 1);
+
+	return S;
+}
+
+/*
+ * Start the function at index 3 of the callbacks thread
+ * in a new thread with the values above it as arguments
+ */
+static void callback_start(lua_State *S)
+{
+	int nargs = lua_gettop(S) - 3;
+	lua_State *T = lua_newthread(S);
+
+	lua_insert(S, 3);
+
+	/* push nil to let whoever sees the end of this thread
+	 * know that nothing further needs to be done */
+	lua_pushnil(T);
+	/* move the function and arguments there */
+	lua_xmove(S, T, nargs + 1);
+
+	thread_resume(T, nargs);
+}
+
+/*
+ * Timers started from Lua
+ */
+typedef struct {
+	struct timer t;
+	simpledbus_loop *loop;
+	unsigned int interval; /* 0 for one-shot timers */
+} LTimer;
+
+static void ltimer_expired(struct timer *t)
+{
+	LTimer *lt = (LTimer *)t;
+	lua_State *S = callback_get(lt->loop, lt);
+
+	if (lt->interval) {
+		uint64_t next = t->expires + lt->interval;
+		uint64_t now = timer_now();
+
+		/* don't try to catch up on missed intervals */
+		if (next <= now)
+			next = now + lt->interval;
+		timer_add(&lt->loop->wheel, t, next);
+	} else
+		unanchor(S, 1, 2);
+
+	if (lua_isthread(S, 3)) {
+		/* a sleeping thread, it is kept
+		 * referenced on our stack while it runs */
+		thread_resume(lua_tothread(S, 3), 0);
+	} else {
+		/* call the function with the timer as argument */
+		lua_pushvalue(S, 2);
+		callback_start(S);
+	}
+
+	lua_settop(S, 1);
+}
+
+static int new_timer(lua_State *L, unsigned int repeat)
+{
+	lua_Number ms = luaL_checknumber(L, 1);
+	simpledbus_loop *l = loop_get(L);
+	LTimer *lt;
+
+	luaL_checktype(L, 2, LUA_TFUNCTION);
+	lua_settop(L, 2);
+
+	if (ms < 0)
+		ms = 0;
+	if (repeat && ms < 1)
+		return luaL_argerror(L, 1, "interval must be at least 1ms");
+
+	lt = lua_newuserdata(L, sizeof(LTimer));
+	timer_init(&lt->t, ltimer_expired);
+	lt->loop = l;
+	lt->interval = repeat ? (unsigned int)ms : 0;
+
+	/* set the metatable */
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_setmetatable(L, 3);
+
+	/* get the callback table and anchor the timer */
+	lua_pushlightuserdata(L, &callbacks_key);
+	lua_rawget(L, LUA_REGISTRYINDEX);
+	anchor(L, 4, 3, 2);
+	lua_settop(L, 3);
+
+	timer_add(&l->wheel, &lt->t, timer_now() + (uint64_t)ms);
+
+	/* return the timer */
+	return 1;
+}
+
+/*
+ * after()
+ *
+ * upvalue 1: Timer
+ *
+ * argument 1: milliseconds
+ * argument 2: function
+ */
+static int simpledbus_after(lua_State *L)
+{
+	return new_timer(L, 0);
+}
+
+/*
+ * every()
+ *
+ * upvalue 1: Timer
+ *
+ * argument 1: milliseconds
+ * argument 2: function
+ */
+static int simpledbus_every(lua_State *L)
+{
+	return new_timer(L, 1);
+}
+
+/*
+ * now()
+ *
+ * Returns the seconds on the monotonic clock
+ * with microsecond resolution
+ */
+static int simpledbus_now(lua_State *L)
+{
+	lua_pushnumber(L, (lua_Number)now_us() / 1000000);
+	return 1;
+}
+
+/*
+ * sleep()
+ *
+ * argument 1: milliseconds
+ */
+static int simpledbus_sleep(lua_State *L)
+{
+	lua_Number ms = luaL_checknumber(L, 1);
+	simpledbus_loop *l = loop_get(L);
+	LTimer *lt;
+
+	if (l->mainThread == NULL || L == l->mainThread)
+		return luaL_error(L, "sleep() must be called from "
+				"a thread running in the main loop");
+
+	if (ms < 0)
+		ms = 0;
+
+	lua_settop(L, 0);
+
+	lt = lua_newuserdata(L, sizeof(LTimer));
+	timer_init(&lt->t, ltimer_expired);
+	lt->loop = l;
+	lt->interval = 0;
+
+	/* anchor the timer and this thread */
+	lua_pushlightuserdata(L, &callbacks_key);
+	lua_rawget(L, LUA_REGISTRYINDEX);
+	lua_pushthread(L);
+	anchor(L, 2, 1, 3);
+	lua_settop(L, 0);
+
+	timer_add(&l->wheel, &lt->t, timer_now() + (uint64_t)ms);
+
+	return lua_yield(L, 0);
+}
+
+/*
+ * Timer:cancel()
+ *
+ * upvalue 1: Timer
+ *
+ * argument 1: timer
+ */
+static int timer_cancel(lua_State *L)
+{
+	LTimer *lt;
+	int r;
+
+	if (lua_getmetatable(L, 1) == 0)
+		return luaL_argerror(L, 1, "expected a timer");
+	r = lua_equal(L, lua_upvalueindex(1), -1);
+	lua_pop(L, 1);
+	if (r == 0)
+		return luaL_argerror(L, 1, "expected a timer");
+
+	lt = lua_touserdata(L, 1);
+	lua_settop(L, 1);
+
+	timer_del(&lt->loop->wheel, &lt->t);
+
+	lua_pushlightuserdata(L, &callbacks_key);
+	lua_rawget(L, LUA_REGISTRYINDEX);
+	unanchor(L, 2, 1);
+
+	/* return true */
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/*
+ * Watched file descriptors. epoll only takes one registration
+ * per fd, so the watches of an fd share a struct fdmux, which
+ * registers the union of their events and passes the events
+ * on to each watch waiting for them.
+ */
+typedef struct lfd LFd;
+
+struct fdmux {
+	struct source s;
+	simpledbus_loop *loop;
+	int fd;
+	uint32_t events;        /* registered with epoll */
+	int busy;               /* in fdmux_ready(), so don't free it */
+	LFd *watches;
+};
+
+struct lfd {
+	simpledbus_loop *loop;
+	int fd;                 /* -1 when cancelled */
+	uint32_t events;
+	uint32_t ready;         /* events not yet passed on */
+	struct fdmux *mux;
+	LFd *next;
+};
+
+static uint32_t check_mode(lua_State *L, int index)
+{
+	const char *mode = luaL_checkstring(L, index);
+	uint32_t events = 0;
+
+	for (; *mode; mode++) {
+		switch (*mode) {
+		case 'r':
+			events |= EPOLLIN;
+			break;
+		case 'w':
+			events |= EPOLLOUT;
+			break;
+		default:
+			luaL_argerror(L, index,
+					"mode must be 'r', 'w' or 'rw'");
+		}
+	}
+
+	if (events == 0)
+		luaL_argerror(L, index, "mode must be 'r', 'w' or 'rw'");
+
+	return events;
+}
+
+/*
+ * The userdata of a source may be collected once it's
+ * unanchored, so make sure we don't see it later in the
+ * batch of events being handled
+ */
+static void batch_forget(simpledbus_loop *l, struct source *s)
+{
+	int i;
+
+	for (i = 0; i < l->batch_n; i++) {
+		if (l->batch[i].data.ptr == s)
+			l->batch[i].data.ptr = NULL;
+	}
+}
+
+static uint32_t fdmux_events(struct fdmux *m)
+{
+	uint32_t events = 0;
+	LFd *w;
+
+	for (w = m->watches; w; w = w->next)
+		events |= w->events;
+
+	return events;
+}
+
+static int fdmux_ctl(struct fdmux *m, uint32_t events)
+{
+	struct epoll_event ev;
+	int r;
+
+	ev.events = events;
+	ev.data.ptr = &m->s;
+
+	/* epoll forgets the fd when it's closed,
+	 * and the number may be in use again now */
+	r = epoll_ctl(m->loop->epfd, EPOLL_CTL_MOD, m->fd, &ev);
+	if (r && errno == ENOENT)
+		r = epoll_ctl(m->loop->epfd, EPOLL_CTL_ADD, m->fd, &ev);
+	if (r == 0)
+		m->events = events;
+
+	return r;
+}
+
+/*
+ * Register the events of the watches left,
+ * or forget about the fd when there are none
+ */
+static void fdmux_update(struct fdmux *m)
+{
+	simpledbus_loop *l = m->loop;
+	struct epoll_event ev;
+
+	if (m->watches) {
+		uint32_t events = fdmux_events(m);
+
+		if (events != m->events)
+			(void)fdmux_ctl(m, events);
+		return;
+	}
+
+	/* the fd might already be closed, so ignore errors */
+	(void)epoll_ctl(l->epfd, EPOLL_CTL_DEL, m->fd, &ev);
+	batch_forget(l, &m->s);
+	l->fdmux[m->fd] = NULL;
+
+	if (!m->busy)
+		free(m);
+}
+
+static void lfd_unregister(LFd *w)
+{
+	struct fdmux *m = w->mux;
+	LFd **p;
+
+	for (p = &m->watches; *p != w; p = &(*p)->next)
+		;
+	*p = w->next;
+
+	w->mux = NULL;
+	w->next = NULL;
+	w->fd = -1;
+
+	fdmux_update(m);
+}
+
+static void lfd_ready(LFd *w, uint32_t events)
+{
+	lua_State *S = callback_get(w->loop, w);
+
+	if (lua_isthread(S, 3)) {
+		/* a thread waiting in wait_readable()
+		 * or wait_writable(), so wake it up once */
+		lfd_unregister(w);
+		unanchor(S, 1, 2);
+		lua_pushboolean(lua_tothread(S, 3), 1);
+		thread_resume(lua_tothread(S, 3), 1);
+	} else {
+		/* call the function with the watch and
+		 * whether the fd is readable and writable */
+		lua_pushvalue(S, 2);
+		lua_pushboolean(S, events & (EPOLLIN|EPOLLHUP|EPOLLERR));
+		lua_pushboolean(S, events & (EPOLLOUT|EPOLLERR));
+		callback_start(S);
+	}
+
+	lua_settop(S, 1);
+}
+
+/*
+ * Pass the events on to the watches waiting for them. Watches
+ * may be cancelled, and even collected, by the ones run before
+ * them, so look for the next one from the start every time.
+ */
+static void fdmux_ready(struct source *s, uint32_t events)
+{
+	struct fdmux *m = (struct fdmux *)s;
+	LFd *w;
+
+	for (w = m->watches; w; w = w->next)
+		w->ready = events & (w->events | EPOLLHUP | EPOLLERR);
+
+	m->busy = 1;
+	for (;;) {
+		uint32_t ready;
+
+		for (w = m->watches; w && w->ready == 0; w = w->next)
+			;
+		if (w == NULL)
+			break;
+
+		ready = w->ready;
+		w->ready = 0;
+		lfd_ready(w, ready);
+	}
+	m->busy = 0;
+
+	/* every watch was cancelled */
+	if (m->watches == NULL)
+		free(m);
+}
+
+static int lfd_register(LFd *w)
+{
+	simpledbus_loop *l = w->loop;
+	struct fdmux *m;
+
+	if (w->fd >= l->fdmux_size) {
+		int size = l->fdmux_size ? 2*l->fdmux_size : 16;
+		struct fdmux **p;
+
+		while (size <= w->fd)
+			size *= 2;
+		p = realloc(l->fdmux, size * sizeof(struct fdmux *));
+		if (p == NULL)
+			return -1;
+		memset(p + l->fdmux_size, 0,
+				(size - l->fdmux_size) * sizeof(struct fdmux *));
+		l->fdmux = p;
+		l->fdmux_size = size;
+	}
+
+	m = l->fdmux[w->fd];
+	if (m == NULL) {
+		struct epoll_event ev;
+
+		m = malloc(sizeof(struct fdmux));
+		if (m == NULL)
+			return -1;
+
+		ev.events = w->events;
+		ev.data.ptr = &m->s;
+		if (epoll_ctl(l->epfd, EPOLL_CTL_ADD, w->fd, &ev)) {
+			free(m);
+			return -1;
+		}
+
+		m->s.ready = fdmux_ready;
+		m->loop = l;
+		m->fd = w->fd;
+		m->events = w->events;
+		m->busy = 0;
+		m->watches = NULL;
+		l->fdmux[w->fd] = m;
+	} else if ((m->events | w->events) != m->events &&
+			fdmux_ctl(m, m->events | w->events))
+		return -1;
+
+	w->mux = m;
+	w->next = m->watches;
+	m->watches = w;
+
+	return 0;
+}
+
+static LFd *new_lfd(lua_State *L, simpledbus_loop *l, int fd, uint32_t events)
+{
+	LFd *w = lua_newuserdata(L, sizeof(LFd));
+
+	w->loop = l;
+	w->fd = fd;
+	w->events = events;
+	w->ready = 0;
+	w->mux = NULL;
+	w->next = NULL;
+
+	return w;
+}
+
+/*
+ * watch_fd()
+ *
+ * upvalue 1: Watch
+ *
+ * argument 1: file descriptor
+ * argument 2: mode, 'r', 'w' or 'rw'
+ * argument 3: function
+ *
+ * An fd may have several watches, and threads
+ * waiting for it, at the same time.
+ */
+static int simpledbus_watch_fd(lua_State *L)
+{
+	int fd = luaL_checkint(L, 1);
+	uint32_t events = check_mode(L, 2);
+	LFd *w;
+
+	luaL_checktype(L, 3, LUA_TFUNCTION);
+	lua_settop(L, 3);
+
+	w = new_lfd(L, loop_get(L), fd, events);
+
+	/* set the metatable */
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_setmetatable(L, 4);
+
+	if (lfd_register(w)) {
+		lua_pushnil(L);
+		lua_pushfstring(L, "Error watching fd %d: %s",
+				fd, strerror(errno));
+		return 2;
+	}
+
+	/* get the callback table and anchor the watch */
+	lua_pushlightuserdata(L, &callbacks_key);
+	lua_rawget(L, LUA_REGISTRYINDEX);
+	anchor(L, 5, 4, 3);
+	lua_settop(L, 4);
+
+	/* return the watch */
+	return 1;
+}
+
+static int wait_fd(lua_State *L, uint32_t events)
+{
+	int fd = luaL_checkint(L, 1);
+	simpledbus_loop *l = loop_get(L);
+	LFd *w;
+
+	if (l->mainThread == NULL || L == l->mainThread)
+		return luaL_error(L, "waiting for a file descriptor must be "
+				"done from a thread running in the main loop");
+
+	lua_settop(L, 0);
+
+	w = new_lfd(L, l, fd, events);
+	if (lfd_register(w)) {
+		lua_pushnil(L);
+		lua_pushfstring(L, "Error watching fd %d: %s",
+				fd, strerror(errno));
+		return 2;
+	}
+
+	/* anchor the watch and this thread */
+	lua_pushlightuserdata(L, &callbacks_key);
+	lua_rawget(L, LUA_REGISTRYINDEX);
+	lua_pushthread(L);
+	anchor(L, 2, 1, 3);
+	lua_settop(L, 0);
+
+	return lua_yield(L, 0);
+}
+
+/*
+ * wait_readable()
+ *
+ * argument 1: file descriptor
+ */
+static int simpledbus_wait_readable(lua_State *L)
+{
+	return wait_fd(L, EPOLLIN);
+}
+
+/*
+ * wait_writable()
+ *
+ * argument 1: file descriptor
+ */
+static int simpledbus_wait_writable(lua_State *L)
+{
+	return wait_fd(L, EPOLLOUT);
+}
+
+static LFd *watch_check(lua_State *L, int index)
+{
+	int r;
+
+	if (lua_getmetatable(L, index) == 0)
+		luaL_argerror(L, index, "expected a watch");
+
+	r = lua_equal(L, lua_upvalueindex(1), -1);
+	lua_pop(L, 1);
+	if (r == 0)
+		luaL_argerror(L, index, "expected a watch");
+
+	return (LFd *)lua_touserdata(L, index);
+}
+
+/*
+ * Watch:set_mode()
+ *
+ * upvalue 1: Watch
+ *
+ * argument 1: watch
+ * argument 2: mode, 'r', 'w' or 'rw'
+ */
+static int watch_set_mode(lua_State *L)
+{
+	LFd *w = watch_check(L, 1);
+	uint32_t events = check_mode(L, 2);
+	uint32_t old = w->events;
+
+	if (w->fd < 0)
+		return luaL_error(L, "watch is cancelled");
+
+	w->events = events;
+	events = fdmux_events(w->mux);
+	if (events != w->mux->events && fdmux_ctl(w->mux, events)) {
+		w->events = old;
+		lua_pushnil(L);
+		lua_pushfstring(L, "Error watching fd %d: %s",
+				w->fd, strerror(errno));
+		return 2;
+	}
+
+	/* return true */
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/*
+ * Watch:cancel()
+ *
+ * upvalue 1: Watch
+ *
+ * argument 1: watch
+ */
+static int watch_cancel(lua_State *L)
+{
+	LFd *w = watch_check(L, 1);
+
+	lua_settop(L, 1);
+
+	if (w->fd >= 0) {
+		lfd_unregister(w);
+
+		lua_pushlightuserdata(L, &callbacks_key);
+		lua_rawget(L, LUA_REGISTRYINDEX);
+		unanchor(L, 2, 1);
+	}
+
+	/* return true */
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static LCon *bus_check(lua_State *L, int index)
+{
+	int r;
+
+	if (lua_getmetatable(L, index) == 0)
+		luaL_argerror(L, index,
+				"expected a DBus connection");
+
+	r = lua_equal(L, lua_upvalueindex(1), -1);
+	lua_pop(L, 1);
+	if (r == 0)
+		luaL_argerror(L, index,
+				"expected a DBus connection");
+
+	return (LCon *)lua_touserdata(L, index);
+}
+
+/*
+ * Bus:get_signal_table()
+ *
+ * argument 1: bus
+ */
+static int bus_get_signal_table(lua_State *L)
+{
+	(void)bus_check(L, 1);
+
+	lua_getfenv(L, 1);
+	lua_rawgeti(L, 2, 2);
+
+	return 1;
+}
+
+/*
+ * Find the latency histogram of interface.member in table t
+ * of the histogram thread H, creating it on first use
+ */
+static struct hist *latency_hist(lua_State *H, int t,
+		const char *interface, const char *member)
+{
+	struct hist *h;
+
+	lua_pushfstring(H, "%s.%s", interface ? interface : "",
+			member ? member : "");
+	lua_pushvalue(H, -1);
+	lua_rawget(H, t);
+	h = lua_touserdata(H, -1);
+	if (h) {
+		lua_pop(H, 2);
+		return h;
+	}
+	lua_pop(H, 1);
+
+	h = lua_newuserdata(H, sizeof(struct hist));
+	hist_reset(h);
+	lua_rawset(H, t);
+
+	return h;
+}
+
+/*
+ * Forget about a call and return its thread ready to
+ * be resumed with the result by call_resume(). Nothing else
+ * refers to the thread then, so until it's resumed it is
+ * kept referenced on the stack of the callbacks thread.
+ */
+static lua_State *call_end(struct call *call)
+{
+	lua_State *T = call->T;
+
+	lua_pushthread(T);
+	lua_xmove(T, call->c->w.loop->callbacks, 1);
+
+	*call->pprev = call->next;
+	if (call->next)
+		call->next->pprev = call->pprev;
+	call->c->ncalls--;
+
+	dbus_pending_call_unref(call->pending);
+	free(call);
+
+	/* remove the thread from the threads table */
+	lua_pushthread(T);
+	lua_pushnil(T);
+	lua_rawset(T, -3);
+	/* pop threads table from the thread */
+	lua_pop(T, 1);
+
+	return T;
+}
+
+static void call_resume(simpledbus_loop *l, lua_State *T, int nargs)
+{
+	thread_resume(T, nargs);
+	lua_pop(l->callbacks, 1);
+}
+
+/*
+ * Cancel a call and resume its thread with an error
+ */
+static void call_cancel(struct call *call, const char *msg)
+{
+	simpledbus_loop *l = call->c->w.loop;
+	lua_State *T;
+
+	dbus_pending_call_cancel(call->pending);
+	T = call_end(call);
+
+	lua_pushnil(T);
+	lua_pushstring(T, msg);
+	call_resume(l, T, 2);
+}
+
+static void method_return_handler(DBusPendingCall *pending,
+		struct call *call)
+{
+	DBusMessage *msg = dbus_pending_call_steal_reply(pending);
+	LCon *c = call->c;
+	DBusConnection *conn = c->conn;
+	simpledbus_unmarshal unmarshal = call->unmarshal;
+	lua_State *T;
+	DBusError err;
+	int nargs;
+
+	if (msg)
+		hist_add(call->hist, now_us() - call->start);
+	T = call_end(call);
+
+	if (msg == NULL) {
+		lua_pushnil(T);
+		lua_pushliteral(T, "Reply null");
+		nargs = 2;
+	} else {
+		c->stats.received[dbus_message_get_type(msg)]++;
+		switch (dbus_message_get_type(msg)) {
+		case DBUS_MESSAGE_TYPE_METHOD_RETURN:
+			nargs = unmarshal(T, msg);
+			dbus_message_unref(msg);
+			break;
+		case DBUS_MESSAGE_TYPE_ERROR:
+			lua_pushnil(T);
+			dbus_error_init(&err);
+			dbus_set_error_from_message(&err, msg);
+			/* libdbus fails the calls in flight with
+			 * NoReply when the connection is lost */
+			if (!dbus_connection_get_is_connected(conn) &&
+					dbus_error_has_name(&err,
+						DBUS_ERROR_NO_REPLY))
+				lua_pushliteral(T, "Disconnected");
+			else
+				lua_pushstring(T, err.message);
+			dbus_error_free(&err);
+			dbus_message_unref(msg);
+			nargs = 2;
+			break;
+		default:
+			dbus_message_unref(msg);
+			lua_pushnil(T);
+			lua_pushliteral(T, "Unknown reply");
+			nargs = 2;
+		}
+	}
+
+	call_resume(c->w.loop, T, nargs);
+}
+
+/*
+ * libdbus refuses to send unix fds over a connection that can't
+ * pass them, which would be reported as a lost connection or
+ * running out of memory, so check for that first
+ */
+static int cant_pass_fds(DBusConnection *conn, DBusMessage *msg)
+{
+	return dbus_message_contains_unix_fds(msg) &&
+		!dbus_connection_can_send_type(conn, DBUS_TYPE_UNIX_FD);
+}
+
+#define CANT_PASS_FDS "Connection can't pass unix fds"
+
+/*
+ * Send the method call msg over the bus at index and
+ * return the results pushed from the reply by unmarshal.
+ * If the main loop is running L yields until the reply
+ * arrives, otherwise this blocks. The reference to msg is
+ * released here, whether the call is sent or not.
+ */
+static int call_message(lua_State *L, int index, LCon *c,
+		DBusMessage *msg, simpledbus_unmarshal unmarshal)
+{
+	struct hist *hist;
+	uint64_t start;
+	DBusMessage *ret;
+	DBusError err;
+
+	if (cant_pass_fds(c->conn, msg)) {
+		dbus_message_unref(msg);
+		lua_pushnil(L);
+		lua_pushliteral(L, CANT_PASS_FDS);
+		return 2;
+	}
+
+	hist = latency_hist(c->H, 1, dbus_message_get_interface(msg),
+			dbus_message_get_member(msg));
+	start = now_us();
+
+	/* if (!lua_pushthread(L)) { / * L can be yielded */
+	if (c->w.loop->mainThread) { /* main loop is running */
+		DBusPendingCall *pending;
+		struct call *call = malloc(sizeof(struct call));
+
+		if (call == NULL) {
+			dbus_message_unref(msg);
+			lua_pushnil(L);
+			lua_pushliteral(L, "Out of memory");
+			return 2;
+		}
+
+		if (!dbus_connection_send_with_reply(c->conn, msg, &pending, -1)) {
+			free(call);
+			dbus_message_unref(msg);
+			lua_pushnil(L);
+			lua_pushliteral(L, "Out of memory");
+			return 2;
+		}
+
+		/* the message is queued now, so free it */
+		dbus_message_unref(msg);
+
+		if (pending == NULL) {
+			free(call);
+			lua_pushnil(L);
+			lua_pushliteral(L, "Not connected");
+			return 2;
+		}
+		c->stats.sent[DBUS_MESSAGE_TYPE_METHOD_CALL]++;
+
+		if (!dbus_pending_call_set_notify(pending,
+					(DBusPendingCallNotifyFunction)
+					method_return_handler, call, NULL)) {
+			dbus_pending_call_cancel(pending);
+			dbus_pending_call_unref(pending);
+			free(call);
+			lua_pushnil(L);
+			lua_pushliteral(L, "Out of memory");
+			return 2;
+		}
+
+		call->c = c;
+		call->pending = pending;
+		call->T = L;
+		call->unmarshal = unmarshal;
+		call->hist = hist;
+		call->start = start;
+		call->next = c->calls;
+		if (c->calls)
+			c->calls->pprev = &call->next;
+		call->pprev = &c->calls;
+		c->calls = call;
+		c->ncalls++;
+
+		/* get the threads table */
+		lua_getfenv(L, index);
+		lua_replace(L, 1);
+		lua_settop(L, 1);
+		/* save the thread there */
 		lua_pushthread(L);
 		lua_pushboolean(L, 1);
-		lua_rawset(L, 2);
-		/* yield the threads table */
-		return lua_yield(L, 1);
+		lua_rawset(L, 1);
+		/* yield the threads table */
+		return lua_yield(L, 1);
+	}
+	/* lua_pop(L, 1); */
+
+	/* L is the main thread, so we call the method synchronously */
+	dbus_error_init(&err);
+	ret = dbus_connection_send_with_reply_and_block(c->conn, msg, -1, &err);
+
+	/* free message */
+	dbus_message_unref(msg);
+
+	/* check reply */
+	if (ret == NULL) {
+		lua_pushnil(L);
+		if (dbus_error_is_set(&err)) {
+			lua_pushstring(L, err.message);
+			dbus_error_free(&err);
+		} else
+			lua_pushliteral(L, "Reply null");
+		return 2;
+	}
+
+	c->stats.sent[DBUS_MESSAGE_TYPE_METHOD_CALL]++;
+	c->stats.received[dbus_message_get_type(ret)]++;
+	hist_add(hist, now_us() - start);
+
+	switch (dbus_message_get_type(ret)) {
+	case DBUS_MESSAGE_TYPE_METHOD_RETURN:
+		{
+			/* read the parameters */
+			int nargs = unmarshal(L, ret);
+			dbus_message_unref(ret);
+
+			return nargs;
+		}
+	case DBUS_MESSAGE_TYPE_ERROR:
+		lua_pushnil(L);
+		dbus_set_error_from_message(&err, ret);
+		lua_pushstring(L, err.message);
+		dbus_error_free(&err);
+		dbus_message_unref(ret);
+		return 2;
+	}
+
+	dbus_message_unref(ret);
+
+	lua_pushnil(L);
+	lua_pushliteral(L, "Unknown reply");
+	return 2;
+}
+
+/*
+ * Create a method call to the target, object, interface and
+ * method at index 2 to 5 with the arguments following the
+ * signature at index sig. Returns NULL if out of memory.
+ */
+static DBusMessage *new_method_call(lua_State *L, int sig)
+{
+	const char *interface;
+	DBusMessage *msg;
+
+#ifdef DEBUG
+	printf("Calling:\n  %s\n  %s\n  %s\n  %s\n  %s\n",
+				lua_tostring(L, 2),
+				lua_tostring(L, 3),
+				lua_tostring(L, 4),
+				lua_tostring(L, 5),
+				lua_tostring(L, sig));
+	fflush(stdout);
+#endif
+
+	/* create a new method call and check for errors */
+	interface = lua_tostring(L, 4);
+	if (interface && *interface == '\0')
+		interface = NULL;
+
+	msg = dbus_message_new_method_call(
+				lua_tostring(L, 2),
+				lua_tostring(L, 3),
+				interface,
+				lua_tostring(L, 5));
+	if (msg == NULL)
+		return NULL;
+
+	/* get the signature and add arguments */
+	if (lua_isstring(L, sig)) {
+		const char *signature = lua_tostring(L, sig);
+		if (*signature && add_arguments(L, sig + 1,
+					lua_gettop(L), signature, msg)) {
+			dbus_message_unref(msg);
+			lua_error(L);
+		}
+	}
+
+	return msg;
+}
+
+/*
+ * Bus:call_method()
+ *
+ * argument 1: bus
+ * argument 2: target
+ * argument 3: object
+ * argument 4: interface
+ * argument 5: method
+ * argument 6: no reply
+ * argument 7: signature (optional)
+ * ...
+ */
+static int bus_call_method(lua_State *L)
+{
+	LCon *c = bus_check(L, 1);
+	DBusMessage *msg;
+	dbus_bool_t ret;
+
+	msg = new_method_call(L, 7);
+	if (msg == NULL) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "Out of memory");
+		return 2;
+	}
+
+        if (lua_toboolean(L, 6)) {
+            if (cant_pass_fds(c->conn, msg)) {
+                    dbus_message_unref(msg);
+                    lua_pushnil(L);
+                    lua_pushliteral(L, CANT_PASS_FDS);
+                    return 2;
+            }
+
+            ret = dbus_connection_send(c->conn, msg, NULL);
+            dbus_message_unref(msg);
+
+            if (ret == FALSE) {
+                    lua_pushnil(L);
+                    lua_pushliteral(L, "Out of memory");
+                    return 2;
+            }
+            c->stats.sent[DBUS_MESSAGE_TYPE_METHOD_CALL]++;
+
+            /* return true */
+            lua_pushboolean(L, 1);
+            return 1;
+        }
+
+	return call_message(L, 1, c, msg, push_arguments);
+}
+
+/*
+ * Bus:call_lazy()
+ *
+ * argument 1: bus
+ * argument 2: target
+ * argument 3: object
+ * argument 4: interface
+ * argument 5: method
+ * argument 6: signature (optional)
+ * ...
+ *
+ * Like Bus:call_method(), but returns the reply as a Message
+ * so its arguments are only decoded when asked for
+ */
+static int bus_call_lazy(lua_State *L)
+{
+	LCon *c = bus_check(L, 1);
+	DBusMessage *msg;
+
+	msg = new_method_call(L, 6);
+	if (msg == NULL) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "Out of memory");
+		return 2;
+	}
+
+	return call_message(L, 1, c, msg, message_push);
+}
+
+/* this magic string representation of an incoming
+ * signal must match the one in the Lua code */
+#define push_signal_string(L, object, interface, signal) \
+	lua_pushfstring(L, "%s\n%s\n%s", object, interface, signal)
+
+/*
+ * Filter for every incoming message, except replies to our calls.
+ * Signals are dispatched to the handlers in the signal table.
+ */
+/*
+ * Run the function on top of S in a new thread
+ * with the signal as arguments
+ */
+static void signal_run(lua_State *S, DBusMessage *msg, int lazy)
+{
+	/* create new Lua thread */
+	lua_State *T = lua_newthread(S);
+
+	lua_insert(S, -2);
+	/* push nil to let whoever sees the end of this thread
+	 * know that nothing further needs to be done */
+	lua_pushnil(T);
+	/* move the Lua signal handler there */
+	lua_xmove(S, T, 1);
+
+	switch (lua_resume(T, lazy ? message_push(T, msg) :
+				push_arguments(T, msg))) {
+	case 0: /* thread finished */
+	case LUA_YIELD:	/* thread yielded */
+		/* just forget about it */
+		lua_settop(S, 2);
+		break;
+	default: /* thread errored */
+		lua_settop(S, 2);
+		loop_error(T);
+	}
+}
+
+static DBusHandlerResult signal_handler(DBusConnection *conn,
+		DBusMessage *msg, LCon *c)
+{
+	lua_State *S = c->S;
+	int type;
+	int lazy;
+
+	if (msg == NULL)
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+	type = dbus_message_get_type(msg);
+	c->stats.received[type]++;
+	if (type != DBUS_MESSAGE_TYPE_SIGNAL)
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+	/* remember when the connection is lost,
+	 * so the loop can let go of it */
+	if (dbus_message_is_signal(msg, DBUS_INTERFACE_LOCAL,
+				"Disconnected")) {
+		c->disconnected = 1;
+		c->w.loop->disconnects++;
+	}
+
+	/* tell the owner hook about owner changes, but only
+	 * when they come from the bus itself and not from
+	 * someone sending us a NameOwnerChanged of their own */
+	if (lua_isfunction(S, 2) &&
+			dbus_message_is_signal(msg, DBUS_INTERFACE_DBUS,
+				"NameOwnerChanged") &&
+			dbus_message_has_sender(msg, DBUS_SERVICE_DBUS) &&
+			dbus_message_has_path(msg, DBUS_PATH_DBUS)) {
+		lua_pushvalue(S, 2);
+		signal_run(S, msg, 0);
+	}
+
+	push_signal_string(S,
+			dbus_message_get_path(msg),
+			dbus_message_get_interface(msg),
+			dbus_message_get_member(msg));
+#ifdef DEBUG
+	printf("received \"%s\"\n", lua_tostring(S, 3));
+	fflush(stdout);
+#endif
+	lua_rawget(S, 1); /* signal handler table */
+	/* a handler in a table wants the message itself */
+	lazy = lua_istable(S, 3);
+	if (lazy) {
+		lua_rawgeti(S, 3, 1);
+		lua_replace(S, 3);
+	}
+	if (lua_type(S, 3) != LUA_TFUNCTION) {
+		lua_settop(S, 2);
+		c->stats.signals_unmatched++;
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+	}
+	c->stats.signals_matched++;
+
+	signal_run(S, msg, lazy);
+
+	return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+/*
+ * Bus:set_owner_hook()
+ *
+ * argument 1: bus
+ * argument 2: function called with name, old owner and new owner
+ *             for every NameOwnerChanged signal sent by the bus
+ *             itself, or nil
+ *
+ * The hook is called before, and independently of,
+ * the signal table, so handlers set there still
+ * get the signal too.
+ */
+static int bus_set_owner_hook(lua_State *L)
+{
+	LCon *c = bus_check(L, 1);
+
+	if (!lua_isnoneornil(L, 2))
+		luaL_checktype(L, 2, LUA_TFUNCTION);
+	lua_settop(L, 2);
+
+	lua_xmove(L, c->S, 1);
+	lua_replace(c->S, 2);
+
+	/* return true */
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/*
+ * Bus:send_signal()
+ *
+ * argument 1: connection
+ * argument 2: path
+ * argument 3: interface
+ * argument 4: name
+ * argument 5: signature (optional)
+ * ...
+ */
+static int bus_send_signal(lua_State *L)
+{
+	LCon *c = bus_check(L, 1);
+	const char *path = luaL_checkstring(L, 2);
+	const char *interface = luaL_checkstring(L, 3);
+	const char *name = luaL_checkstring(L, 4);
+	DBusMessage *msg;
+	dbus_bool_t r;
+
+	if (interface && *interface == '\0')
+		interface = NULL;
+
+	msg = dbus_message_new_signal(path, interface, name);
+	if (msg == NULL) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "Out of memory");
+		return 2;
+	}
+
+	if (lua_isstring(L, 5)) {
+		const char *signature = lua_tostring(L, 5);
+		if (*signature &&
+				add_arguments(L, 6, lua_gettop(L), signature, msg))
+			return lua_error(L);
+	}
+
+	if (cant_pass_fds(c->conn, msg)) {
+		dbus_message_unref(msg);
+		lua_pushnil(L);
+		lua_pushliteral(L, CANT_PASS_FDS);
+		return 2;
+	}
+
+	r = dbus_connection_send(c->conn, msg, NULL);
+	dbus_message_unref(msg);
+
+	if (r == FALSE) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "Out of memory");
+		return 2;
+	}
+	c->stats.sent[DBUS_MESSAGE_TYPE_SIGNAL]++;
+
+	/* return true */
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/*
+ * A signal prepared by prepare_signal() holds a message with
+ * the arguments marshalled once. Bus:emit() sends a copy of it
+ * with the path changed for each object emitting the signal.
+ */
+typedef struct {
+	DBusMessage *msg;
+} LPrepared;
+
+/*
+ * prepare_signal()
+ *
+ * upvalue 1: Prepared
+ *
+ * argument 1: interface
+ * argument 2: signal name
+ * argument 3: signature (optional)
+ * ...
+ */
+static int simpledbus_prepare_signal(lua_State *L)
+{
+	const char *interface = luaL_checkstring(L, 1);
+	const char *name = luaL_checkstring(L, 2);
+	int top = lua_gettop(L);
+	LPrepared *p;
+
+	if (*interface == '\0')
+		interface = NULL;
+
+	p = lua_newuserdata(L, sizeof(LPrepared));
+	p->msg = NULL;
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_setmetatable(L, -2);
+
+	/* the path is set when the signal is emitted */
+	p->msg = dbus_message_new_signal("/", interface, name);
+	if (p->msg == NULL) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "Out of memory");
+		return 2;
+	}
+
+	if (lua_isstring(L, 3)) {
+		const char *signature = lua_tostring(L, 3);
+		if (*signature &&
+				add_arguments(L, 4, top, signature, p->msg))
+			return lua_error(L);
+	}
+
+	return 1;
+}
+
+static int prepared_gc(lua_State *L)
+{
+	LPrepared *p = lua_touserdata(L, 1);
+
+	if (p->msg)
+		dbus_message_unref(p->msg);
+
+	return 0;
+}
+
+static const char *emit_path(LCon *c, DBusMessage *msg, const char *path)
+{
+	DBusMessage *copy;
+	dbus_bool_t r;
+
+	if (path == NULL || !dbus_validate_path(path, NULL))
+		return "Invalid object path";
+
+	if (cant_pass_fds(c->conn, msg))
+		return CANT_PASS_FDS;
+
+	copy = dbus_message_copy(msg);
+	if (copy == NULL || !dbus_message_set_path(copy, path)) {
+		if (copy)
+			dbus_message_unref(copy);
+		return "Out of memory";
+	}
+
+	r = dbus_connection_send(c->conn, copy, NULL);
+	dbus_message_unref(copy);
+	if (r == FALSE)
+		return "Out of memory";
+
+	c->stats.sent[DBUS_MESSAGE_TYPE_SIGNAL]++;
+	return NULL;
+}
+
+/*
+ * Bus:emit()
+ *
+ * upvalue 1: Bus
+ * upvalue 2: Prepared
+ *
+ * argument 1: bus
+ * argument 2: signal returned by prepare_signal()
+ * argument 3: object path or array of object paths
+ */
+static int bus_emit(lua_State *L)
+{
+	LCon *c = bus_check(L, 1);
+	LPrepared *p;
+	const char *msg;
+	int r;
+
+	if (lua_getmetatable(L, 2) == 0)
+		return luaL_argerror(L, 2, "expected a prepared signal");
+	r = lua_equal(L, lua_upvalueindex(2), -1);
+	lua_pop(L, 1);
+	if (r == 0)
+		return luaL_argerror(L, 2, "expected a prepared signal");
+	p = lua_touserdata(L, 2);
+
+	if (lua_istable(L, 3)) {
+		int i, n = (int)lua_objlen(L, 3);
+
+		for (i = 1; i <= n; i++) {
+			lua_rawgeti(L, 3, i);
+			msg = emit_path(c, p->msg, lua_tostring(L, -1));
+			if (msg) {
+				lua_pushnil(L);
+				lua_pushfstring(L, "%s (#%d)", msg, i);
+				return 2;
+			}
+			lua_pop(L, 1);
+		}
+	} else {
+		msg = emit_path(c, p->msg, luaL_checkstring(L, 3));
+		if (msg) {
+			lua_pushnil(L);
+			lua_pushstring(L, msg);
+			return 2;
+		}
+	}
+
+	/* return true */
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int send_reply_on(lua_State *T, DBusConnection *conn,
+		DBusMessage *msg)
+{
+	DBusMessage *reply;
+	LCon *c;
+	int top = lua_gettop(T);
+
+	/* check if the method returned an error */
+	if (top >= 5 && lua_isnil(T, 4)) {
+		const char *name = lua_tostring(T, 5);
+		const char *message = (top >= 6) ? lua_tostring(T, 6) : NULL;
+
+		if (name == NULL) {
+			dbus_message_unref(msg);
+			lua_pushliteral(T, "Return #1 nil, "
+					"expected error name as #2");
+			return 1;
+		}
+		if (message && *message == '\0')
+			message = NULL;
+
+		reply = dbus_message_new_error(msg, name, message);
+		dbus_message_unref(msg);
+		if (reply == NULL) {
+			lua_pushliteral(T, "Out of memory");
+			return 1;
+		}
+	} else {
+		const char *signature;
+
+		reply = dbus_message_new_method_return(msg);
+		dbus_message_unref(msg);
+		if (reply == NULL) {
+			lua_pushliteral(T, "Out of memory");
+			return 1;
+		}
+
+		signature = lua_tostring(T, 3);
+		if (signature && *signature &&
+				add_arguments(T, 4, top, signature, reply)) {
+			/* add_arguments() pushes its own error message */
+			dbus_message_unref(reply);
+			return 1;
+		}
+	}
+
+	if (cant_pass_fds(conn, reply)) {
+		dbus_message_unref(reply);
+		lua_pushliteral(T, CANT_PASS_FDS);
+		return 1;
+	}
+
+	if (!dbus_connection_send(conn, reply, NULL)) {
+		lua_pushliteral(T, "Out of memory");
+		return 1;
+	}
+
+	/* the bus may be gone or reconnected by now */
+	c = dbus_connection_get_data(conn, lcon_slot);
+	if (c)
+		c->stats.sent[dbus_message_get_type(reply)]++;
+
+	dbus_message_unref(reply);
+
+	return 0;
+}
+
+/*
+ * The thread running a method holds a reference to the
+ * connection until the reply is sent, since the bus may
+ * have reconnected to a new connection by then
+ */
+static int send_reply(lua_State *T)
+{
+	struct request *req = lua_touserdata(T, 2);
+	DBusConnection *conn = req->conn;
+	int r = send_reply_on(T, conn, req->msg);
+
+	/* send_reply_on() releases the message */
+	req->msg = NULL;
+
+	/* the histogram is gone with the bus */
+	if (req->hist && dbus_connection_get_data(conn, lcon_slot))
+		hist_add(req->hist, now_us() - req->start);
+
+	dbus_connection_unref(conn);
+	req->conn = NULL;
+	return r;
+}
+
+/*
+ * Request.__gc()
+ *
+ * argument 1: request
+ */
+static int request_gc(lua_State *L)
+{
+	struct request *req = lua_touserdata(L, 1);
+
+	if (req->msg)
+		dbus_message_unref(req->msg);
+	if (req->conn)
+		dbus_connection_unref(req->conn);
+
+	return 0;
+}
+
+static DBusHandlerResult method_call_handler(DBusConnection *conn,
+		DBusMessage *msg, lua_State *O)
+{
+	uint64_t start = now_us();
+	struct request *req;
+	lua_State *T;
+	LCon *c;
+	int lazy;
+
+#ifdef DEBUG
+	printf("Received message: path = %s,"
+			" interface = %s, member = %s\n",
+			dbus_message_get_path(msg),
+			dbus_message_get_interface(msg),
+			dbus_message_get_member(msg));
+	fflush(stdout);
+#endif
+
+	lua_pushfstring(O, "%s.%s",
+			dbus_message_get_interface(msg),
+			dbus_message_get_member(msg));
+
+	lua_rawget(O, 1);
+	if (!lua_istable(O, 2)) {
+		lua_settop(O, 1);
+#ifdef DEBUG
+		printf("..not handled\n"); fflush(stdout);
+#endif
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+	}
+
+	/* create a new thread to run the method in */
+	T = lua_newthread(O);
+	/* ..and insert it before the function table */
+	lua_insert(O, 2);
+
+	/* push the send_reply function */
+	lua_pushcclosure(T, send_reply, 0);
+
+	/* push the request */
+	req = lua_newuserdata(T, sizeof(struct request));
+	req->conn = dbus_connection_ref(conn);
+	req->msg = dbus_message_ref(msg);
+	req->hist = NULL;
+	req->start = start;
+	lua_pushlightuserdata(T, &request_key);
+	lua_rawget(T, LUA_REGISTRYINDEX);
+	lua_setmetatable(T, -2);
+
+	c = dbus_connection_get_data(conn, lcon_slot);
+	if (c) {
+		c->stats.methods_served++;
+		req->hist = latency_hist(c->H, 2,
+				dbus_message_get_interface(msg),
+				dbus_message_get_member(msg));
+	}
+
+	/* move the return signature and the function to T */
+	lua_rawgeti(O, 3, 2);
+	lua_rawgeti(O, 3, 3);
+	lua_xmove(O, T, 2);
+
+	/* check if the method wants the message itself */
+	lua_getfield(O, 3, "lazy");
+	lazy = lua_toboolean(O, 4);
+
+	/* forget about the function table */
+	lua_settop(O, 2);
+
+	switch (lua_resume(T, lazy ? message_push(T, msg) :
+				push_arguments(T, msg))) {
+	case 0: /* thread finished */
+		if (send_reply(T))
+			loop_error(T);
+	case LUA_YIELD:	/* thread yielded */
+		/* forget about the thread */
+		lua_settop(O, 1);
+		break;
+	default: /* thread errored */
+		lua_settop(O, 1);
+		loop_error(T);
+	}
+
+	return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static const DBusObjectPathVTable vtable = {
+	NULL,
+	(DBusObjectPathMessageFunction)method_call_handler,
+	NULL, NULL, NULL, NULL
+};
+
+/*
+ * Bus:register_object_path()
+ *
+ * argument 1: connection
+ * argument 2: path
+ * argument 3: method table
+ */
+static int bus_register_object_path(lua_State *L)
+{
+	LCon *c = bus_check(L, 1);
+	const char *path = luaL_checkstring(L, 2);
+	lua_State *O;
+
+	luaL_checktype(L, 3, LUA_TTABLE);
+
+	/* drop extra arguments */
+	lua_settop(L, 3);
+
+	/* get the signal/thread table of the conection */
+	lua_getfenv(L, 1);
+	/* ..and move it before the path */
+	lua_insert(L, 2);
+
+	/* check if we already registered this object path */
+	lua_pushvalue(L, 3);
+	lua_rawget(L, 2);
+	if (lua_isthread(L, 5)) {
+		/* just replace the method table */
+		O = lua_tothread(L, 5);
+		lua_xmove(L, O, 1);
+		lua_replace(O, 1);
+		/* return true */
+		lua_pushboolean(L, 1);
+		return 1;
+	}
+	/* clear result of lua_rawget() */
+	lua_settop(L, 4);
+
+	/* move method table before path */
+	lua_insert(L, 3);
+
+	/* create thread for storing object data */
+	O = lua_newthread(L);
+	if (O == NULL) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "Out of memory");
+		return 2;
+	}
+
+	/* register the object path */
+	if (!dbus_connection_register_object_path(c->conn, path, &vtable, O)) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "Out of memory");
+		return 2;
+	}
+
+	/* save the thread in the thread table */
+	lua_rawset(L, 2);
+
+	/* move method table to the thread*/
+	lua_xmove(L, O, 1);
+
+	/* return true */
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/*
+ * Bus:unregister_object_path()
+ *
+ * argument 1: connection
+ * argument 2: path
+ */
+static int bus_unregister_object_path(lua_State *L)
+{
+	LCon *c = bus_check(L, 1);
+	const char *path = luaL_checkstring(L, 2);
+
+	/* drop extra arguments */
+	lua_settop(L, 2);
+
+	/* get the signal/thread table of the conection */
+	lua_getfenv(L, 1);
+	/* ..and move it before the path */
+	lua_insert(L, 2);
+
+	lua_pushvalue(L, 3);
+	lua_rawget(L, 2);
+	if (!lua_isthread(L, 4))
+		return luaL_error(L, "Object path not registered");
+	lua_settop(L, 3);
+
+	lua_pushnil(L);
+	if (!dbus_connection_unregister_object_path(c->conn, path)) {
+		lua_pushliteral(L, "Out of memory");
+		return 2;
+	}
+
+	lua_rawset(L, 2);
+
+	/* return true */
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static void connection_uninstall(LCon *c)
+{
+	if (!c->installed)
+		return;
+	c->installed = 0;
+
+	(void)dbus_connection_set_watch_functions(c->conn,
+			NULL, NULL, NULL, NULL, NULL);
+	(void)dbus_connection_set_timeout_functions(c->conn,
+			NULL, NULL, NULL, NULL, NULL);
+	dbus_connection_remove_filter(c->conn,
+			(DBusHandleMessageFunction)signal_handler, c);
+	(void)dbus_connection_set_data(c->conn, lcon_slot, NULL, NULL);
+}
+
+/*
+ * Hook the connection up to the loop and set the filters,
+ * returns an error message or NULL. On errors nothing is
+ * left hooked up.
+ */
+static const char *connection_install(LCon *c)
+{
+	const char *msg;
+
+	/* set watch functions */
+	if (!dbus_connection_set_watch_functions(c->conn,
+				(DBusAddWatchFunction)add_watch_cb,
+				(DBusRemoveWatchFunction)remove_watch_cb,
+				(DBusWatchToggledFunction)toggle_watch_cb,
+				&c->w, NULL))
+		return "Error setting watch functions";
+
+	/* set timeout functions */
+	if (!dbus_connection_set_timeout_functions(c->conn,
+				(DBusAddTimeoutFunction)add_timeout_cb,
+				(DBusRemoveTimeoutFunction)remove_timeout_cb,
+				(DBusTimeoutToggledFunction)toggle_timeout_cb,
+				c->w.loop, NULL)) {
+		msg = "Error setting timeout functions";
+		goto unwatch;
+	}
+
+	/* let method handlers find us */
+	if (!dbus_connection_set_data(c->conn, lcon_slot, c, NULL)) {
+		msg = "Out of memory";
+		goto untimeout;
+	}
+
+	/* set the signal handler */
+	if (!dbus_connection_add_filter(c->conn,
+				(DBusHandleMessageFunction)signal_handler,
+				c, NULL)) {
+		msg = "Out of memory";
+		goto unset;
+	}
+
+	c->installed = 1;
+	return NULL;
+
+unset:
+	(void)dbus_connection_set_data(c->conn, lcon_slot, NULL, NULL);
+untimeout:
+	(void)dbus_connection_set_timeout_functions(c->conn,
+			NULL, NULL, NULL, NULL, NULL);
+unwatch:
+	(void)dbus_connection_set_watch_functions(c->conn,
+			NULL, NULL, NULL, NULL, NULL);
+	return msg;
+}
+
+/*
+ * DBus.__gc()
+ */
+static int bus_gc(lua_State *L)
+{
+	LCon *c = lua_touserdata(L, 1);
+
+	/* shared connections outlive us, so make
+	 * sure libdbus forgets about us */
+	connection_uninstall(c);
+	free(c->address);
+
+	/* the threads waiting for replies are going away with us */
+	while (c->calls) {
+		struct call *call = c->calls;
+
+		c->calls = call->next;
+		dbus_pending_call_cancel(call->pending);
+		dbus_pending_call_unref(call->pending);
+		free(call);
+	}
+
+	if (c->private)
+		dbus_connection_close(c->conn);
+	dbus_connection_unref(c->conn);
+
+	watchset_free(&c->w);
+
+	return 0;
+}
+
+/*
+ * mainloop()
+ */
+#define MAX_EVENTS 32
+
+/*
+ * The connections attached to the loop are kept in an array
+ * sorted by priority with their index stored in the connection.
+ * A connection may be attached several times, by mainloop() and
+ * get_fd(), and stays until every attachment is undone.
+ * While dispatchall() walks the array, new connections are
+ * appended and sorted into place when it's done.
+ */
+static int conns_insert(simpledbus_loop *l, LCon *c)
+{
+	unsigned int i;
+
+	if (l->nconns == l->conns_size) {
+		unsigned int size = l->conns_size ? 2*l->conns_size : 4;
+		LCon **p = realloc(l->conns, size * sizeof(LCon *));
+
+		if (p == NULL)
+			return -1;
+
+		l->conns = p;
+		l->conns_size = size;
+	}
+
+	if (l->dispatching) {
+		c->index = l->nconns;
+		l->conns[l->nconns++] = c;
+		l->resort = 1;
+		return 0;
+	}
+
+	/* insert after connections of the same or higher priority */
+	for (i = l->nconns; i > 0; i--) {
+		if (l->conns[i-1]->priority >= c->priority)
+			break;
+		l->conns[i] = l->conns[i-1];
+		l->conns[i]->index = i;
+	}
+
+	c->index = i;
+	l->conns[i] = c;
+	l->nconns++;
+
+	return 0;
+}
+
+/*
+ * Put the connections back in order of priority,
+ * keeping the order of those with the same priority
+ */
+static void conns_sort(simpledbus_loop *l)
+{
+	unsigned int i;
+
+	for (i = 1; i < l->nconns; i++) {
+		LCon *c = l->conns[i];
+		unsigned int j;
+
+		for (j = i; j > 0 && l->conns[j-1]->priority < c->priority; j--)
+			l->conns[j] = l->conns[j-1];
+		l->conns[j] = c;
+	}
+
+	for (i = 0; i < l->nconns; i++)
+		l->conns[i]->index = i;
+
+	l->resort = 0;
+}
+
+static void conns_remove(simpledbus_loop *l, LCon *c)
+{
+	unsigned int i;
+
+	l->nconns--;
+	for (i = c->index; i < l->nconns; i++) {
+		l->conns[i] = l->conns[i+1];
+		l->conns[i]->index = i;
+	}
+}
+
+static int attach(LCon *c)
+{
+	if (c->w.attached++)
+		return 0;
+
+	if (conns_insert(c->w.loop, c)) {
+		c->w.attached = 0;
+		return -1;
+	}
+
+	watchset_poll(&c->w);
+	return 0;
+}
+
+static void detach(LCon *c)
+{
+	if (c->w.attached == 0 || --c->w.attached)
+		return;
+
+	conns_remove(c->w.loop, c);
+	watchset_unpoll(&c->w);
+}
+
+/*
+ * Attach the connection at index for good and anchor it in
+ * the callback table, so it isn't collected while it's polled
+ */
+static int connection_anchor(lua_State *L, LCon *c, int index)
+{
+	if (c->anchored)
+		return 0;
+
+	if (attach(c))
+		return -1;
+	c->anchored = 1;
+
+	/* a reconnect function anchors it already */
+	if (c->reconnect)
+		return 0;
+
+	lua_pushlightuserdata(L, &callbacks_key);
+	lua_rawget(L, LUA_REGISTRYINDEX);
+	lua_pushboolean(L, 1);
+	anchor(L, lua_gettop(L) - 1, index, lua_gettop(L));
+	lua_pop(L, 2);
+
+	return 0;
+}
+
+/*
+ * A disconnected connection can't be used for anything, so
+ * start the reconnect function of the ones that have it and
+ * let go of the ones anchored by get_fd() or a server
+ */
+static void release_disconnected(simpledbus_loop *l)
+{
+	unsigned int i;
+
+	l->disconnects = 0;
+
+	for (i = l->nconns; i > 0; i--) {
+		LCon *c;
+		lua_State *S;
+
+		/* the reconnect functions may detach connections */
+		if (i > l->nconns)
+			continue;
+
+		c = l->conns[i-1];
+		if (!c->disconnected)
+			continue;
+
+		if (c->reconnect) {
+			c->disconnected = 0;
+			S = callback_get(l, c);
+			lua_pushvalue(S, 2);
+			callback_start(S);
+		} else if (c->anchored) {
+			c->anchored = 0;
+			detach(c);
+			S = callback_get(l, c);
+			unanchor(S, 1, 2);
+		} else
+			continue;
+
+		lua_settop(S, 1);
+	}
+}
+
+/*
+ * Dispatch at most budget messages from the incoming queue of c.
+ * The latency of each message is measured from when the last
+ * batch of data was read from the socket. Messages still queued
+ * from earlier reads are undercounted, but under sustained load
+ * the samples don't grow with the time since the queue was empty.
+ */
+static void dispatch(LCon *c)
+{
+	unsigned int left = c->budget;
+	DBusDispatchStatus status;
+
+	status = dbus_connection_get_dispatch_status(c->conn);
+	while (status == DBUS_DISPATCH_DATA_REMAINS) {
+		uint64_t now = now_us();
+
+		/* messages read by a blocking call */
+		if (c->ready_at == 0)
+			c->ready_at = now;
+		hist_add(&c->latency, now - c->ready_at);
+
+		status = dbus_connection_dispatch(c->conn);
+
+		if (left && --left == 0)
+			break;
+	}
+
+	if (status != DBUS_DISPATCH_DATA_REMAINS)
+		c->ready_at = 0;
+}
+
+/*
+ * Dispatch every attached connection, higher priorities first.
+ * Connections of the same priority take turns going first, so
+ * none of them are starved when they all use up their budget.
+ */
+static void dispatchall(simpledbus_loop *l)
+{
+	unsigned int first = 0;
+	unsigned int round = l->round++;
+
+	/* handlers may attach connections or change their priority,
+	 * which must not move the ones we haven't got to yet */
+	l->dispatching = 1;
+	while (first < l->nconns) {
+		int priority = l->conns[first]->priority;
+		unsigned int n = 1;
+		unsigned int i;
+
+		while (first + n < l->nconns &&
+				l->conns[first + n]->priority == priority)
+			n++;
+
+		for (i = 0; i < n; i++)
+			dispatch(l->conns[first + (round + i) % n]);
+
+		first += n;
+	}
+	l->dispatching = 0;
+
+	if (l->resort)
+		conns_sort(l);
+
+	if (l->disconnects)
+		release_disconnected(l);
+}
+
+static void connection_ready(struct source *s, uint32_t events)
+{
+	LCon *c = (LCon *)s;
+	unsigned int flags = watchset_handle(&c->w, events);
+
+	/* remember when messages were read for the latency */
+	if ((flags & DBUS_WATCH_READABLE) &&
+			dbus_connection_get_dispatch_status(c->conn)
+			== DBUS_DISPATCH_DATA_REMAINS)
+		c->ready_at = now_us();
+}
+
+/*
+ * Wait for at most timeout milliseconds and handle
+ * the sources that are ready. Returns the number of
+ * ready file descriptors or -1 on error.
+ */
+static int handleall(simpledbus_loop *l, int timeout)
+{
+	struct epoll_event events[MAX_EVENTS];
+	int r;
+	int i;
+
+	r = epoll_wait(l->epfd, events, MAX_EVENTS, timeout);
+	l->iterations++;
+	if (r < 0)
+		return errno == EINTR ? 0 : -1;
+	if (r > 0)
+		l->wakeups++;
+
+	l->batch = events;
+	l->batch_n = r;
+
+	for (i = 0; i < r; i++) {
+		struct source *s = events[i].data.ptr;
+
+		if (s)
+			s->ready(s, events[i].events);
+	}
+
+	l->batch = NULL;
+	l->batch_n = 0;
+
+	return r;
+}
+
+/*
+ * Other threads push work on the post stack and write to the
+ * eventfd, which wakes up the loop to run it in its own thread
+ */
+static void wake_ready(struct source *s, uint32_t events)
+{
+	simpledbus_loop *l = loop_of(s, wake);
+	lua_State *S = l->callbacks;
+	struct post *p;
+	struct post *next;
+	struct post *list = NULL;
+	uint64_t n;
+
+	if (read(l->wakefd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+		return;
+
+	if (__sync_lock_test_and_set(&l->stop_requested, 0) &&
+			l->mainThread && l->stop == 0) {
+		lua_checkstack(l->mainThread, 1);
+		lua_pushboolean(l->mainThread, 1);
+		l->stop = 1;
+	}
+
+	/* take all the posts and run them in the order
+	 * they were posted */
+	p = __sync_lock_test_and_set(&l->posts, NULL);
+	while (p) {
+		next = p->next;
+		p->next = list;
+		list = p;
+		p = next;
+	}
+
+	for (p = list; p; p = next) {
+		next = p->next;
+		if (lua_cpcall(S, p->func, p->data)) {
+			loop_error(S);
+			lua_settop(S, 1);
+		}
+		free(p);
+	}
+}
+
+static void wakeup(simpledbus_loop *l)
+{
+	uint64_t one = 1;
+
+	/* this only fails if the counter is about to
+	 * overflow, and then the loop will wake up anyway */
+	if (write(l->wakefd, &one, sizeof(one)) < 0)
+		return;
+}
+
+LUALIB_API simpledbus_loop *simpledbus_get_loop(lua_State *L)
+{
+	return loop_get(L);
+}
+
+LUALIB_API int simpledbus_post(simpledbus_loop *l,
+		lua_CFunction func, void *data)
+{
+	struct post *p = malloc(sizeof(struct post));
+
+	if (p == NULL)
+		return -1;
+
+	p->func = func;
+	p->data = data;
+	do {
+		p->next = l->posts;
+	} while (!__sync_bool_compare_and_swap(&l->posts, p->next, p));
+
+	wakeup(l);
+	return 0;
+}
+
+LUALIB_API void simpledbus_request_stop(simpledbus_loop *l)
+{
+	(void)__sync_lock_test_and_set(&l->stop_requested, 1);
+	wakeup(l);
+}
+
+/*
+ * Like bus_check(), but for C functions which don't have
+ * the Bus metatable as an upvalue. The message is freed
+ * before raising an error.
+ */
+static LCon *bus_check_msg(lua_State *L, int index, DBusMessage *msg)
+{
+	int r = 0;
+
+	if (lua_getmetatable(L, index)) {
+		lua_pushlightuserdata(L, &bus_key);
+		lua_rawget(L, LUA_REGISTRYINDEX);
+		r = lua_rawequal(L, -1, -2);
+		lua_pop(L, 2);
+	}
+
+	if (r == 0) {
+		dbus_message_unref(msg);
+		luaL_argerror(L, index, "expected a DBus connection");
+	}
+
+	return (LCon *)lua_touserdata(L, index);
+}
+
+LUALIB_API int simpledbus_call(lua_State *L, int index, DBusMessage *msg,
+		simpledbus_unmarshal unmarshal)
+{
+	LCon *c = bus_check_msg(L, index, msg);
+
+	return call_message(L, index, c, msg, unmarshal);
+}
+
+LUALIB_API int simpledbus_send(lua_State *L, int index, DBusMessage *msg)
+{
+	LCon *c = bus_check_msg(L, index, msg);
+	int type = dbus_message_get_type(msg);
+	dbus_bool_t r;
+
+	if (cant_pass_fds(c->conn, msg)) {
+		dbus_message_unref(msg);
+		lua_pushnil(L);
+		lua_pushliteral(L, CANT_PASS_FDS);
+		return 2;
+	}
+
+	r = dbus_connection_send(c->conn, msg, NULL);
+	dbus_message_unref(msg);
+
+	if (r == FALSE) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "Out of memory");
+		return 2;
+	}
+	c->stats.sent[type]++;
+
+	/* return true */
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+LUALIB_API int simpledbus_add_value(lua_State *L, int index,
+		const char *signature, DBusMessageIter *args)
+{
+	return add_value(L, index, signature, args);
+}
+
+LUALIB_API void simpledbus_push_value(lua_State *L, DBusMessageIter *args)
+{
+	push_value(L, args);
+}
+
+/*
+ * Signals handled from Lua are blocked and read from a signalfd
+ */
+static const struct {
+	const char *name;
+	int signo;
+} signal_names[] = {
+	{"HUP", SIGHUP},
+	{"INT", SIGINT},
+	{"QUIT", SIGQUIT},
+	{"PIPE", SIGPIPE},
+	{"ALRM", SIGALRM},
+	{"TERM", SIGTERM},
+	{"USR1", SIGUSR1},
+	{"USR2", SIGUSR2},
+	{"CHLD", SIGCHLD},
+	{"WINCH", SIGWINCH},
+	{NULL, 0}
+};
+
+static int check_signal(lua_State *L, int index)
+{
+	const char *name;
+	int i;
+
+	if (lua_type(L, index) == LUA_TNUMBER) {
+		int signo = lua_tointeger(L, index);
+
+		if (signo <= 0 || signo >= NSIG || signo == SIGKILL ||
+				signo == SIGSTOP)
+			luaL_argerror(L, index, "invalid signal");
+		return signo;
+	}
+
+	name = luaL_checkstring(L, index);
+	if (strncmp(name, "SIG", 3) == 0)
+		name += 3;
+
+	for (i = 0; signal_names[i].name; i++) {
+		if (strcmp(name, signal_names[i].name) == 0)
+			return signal_names[i].signo;
+	}
+
+	return luaL_argerror(L, index, "unknown signal");
+}
+
+static void push_signal(lua_State *L, int signo)
+{
+	int i;
+
+	for (i = 0; signal_names[i].name; i++) {
+		if (signal_names[i].signo == signo) {
+			lua_pushstring(L, signal_names[i].name);
+			return;
+		}
+	}
+
+	lua_pushinteger(L, signo);
+}
+
+static void sig_ready(struct source *s, uint32_t events)
+{
+	simpledbus_loop *l = loop_of(s, sig);
+	lua_State *S = l->callbacks;
+	struct signalfd_siginfo si;
+
+	while (read(l->sigfd, &si, sizeof(si)) == sizeof(si)) {
+		/* the handlers are stored in the
+		 * signal table under their number */
+		lua_pushnil(S);
+		lua_pushlightuserdata(S, &signals_key);
+		lua_rawget(S, LUA_REGISTRYINDEX);
+		lua_rawgeti(S, 3, (int)si.ssi_signo);
+		lua_remove(S, 3);
+		if (lua_isfunction(S, 3)) {
+			push_signal(S, (int)si.ssi_signo);
+			callback_start(S);
+		}
+		lua_settop(S, 1);
+	}
+}
+
+/*
+ * on_signal()
+ *
+ * argument 1: signal name or number
+ * argument 2: function or nil to stop handling the signal
+ *
+ * The signal is blocked in the calling thread, so this should be
+ * called before any other threads are started. When it is no
+ * longer handled it's unblocked again, unless it was blocked
+ * before it was handled.
+ */
+static int simpledbus_on_signal(lua_State *L)
+{
+	simpledbus_loop *l = loop_get(L);
+	int signo = check_signal(L, 1);
+	int handle = !lua_isnoneornil(L, 2);
+	int handled = sigismember(&l->sigmask, signo);
+	int err;
+	sigset_t set;
+
+	if (handle)
+		luaL_checktype(L, 2, LUA_TFUNCTION);
+	lua_settop(L, 2);
+
+	sigemptyset(&set);
+	sigaddset(&set, signo);
+
+	if (handle && !handled) {
+		sigset_t old;
+
+		(void)pthread_sigmask(SIG_BLOCK, &set, &old);
+		if (sigismember(&old, signo))
+			sigaddset(&l->sigblocked, signo);
+		sigaddset(&l->sigmask, signo);
+	} else if (!handle)
+		sigdelset(&l->sigmask, signo);
+
+	if (l->sigfd < 0) {
+		struct epoll_event ev;
+
+		l->sigfd = signalfd(-1, &l->sigmask,
+				SFD_NONBLOCK | SFD_CLOEXEC);
+		if (l->sigfd < 0)
+			goto error;
+
+		ev.events = EPOLLIN;
+		ev.data.ptr = &l->sig;
+		if (epoll_ctl(l->epfd, EPOLL_CTL_ADD, l->sigfd, &ev)) {
+			close(l->sigfd);
+			l->sigfd = -1;
+			goto error;
+		}
+	} else if (signalfd(l->sigfd, &l->sigmask, 0) < 0)
+		goto error;
+
+	if (!handle && handled) {
+		if (!sigismember(&l->sigblocked, signo))
+			(void)pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+		sigdelset(&l->sigblocked, signo);
 	}
-	/* lua_pop(L, 1); */
 
-	/* L is the main thread, so we call the method synchronously */
-	ret = dbus_connection_send_with_reply_and_block(c->conn, msg, -1, &err);
+	/* save the handler in the signal table */
+	lua_pushlightuserdata(L, &signals_key);
+	lua_rawget(L, LUA_REGISTRYINDEX);
+	lua_pushvalue(L, 2);
+	lua_rawseti(L, 3, signo);
 
-	/* free message */
-	dbus_message_unref(msg);
+	/* return true */
+	lua_pushboolean(L, 1);
+	return 1;
 
-	/* check reply */
-	if (ret == NULL) {
+error:
+	err = errno;
+
+	/* leave the signal as it was */
+	if (handle && !handled) {
+		sigdelset(&l->sigmask, signo);
+		if (!sigismember(&l->sigblocked, signo))
+			(void)pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+		sigdelset(&l->sigblocked, signo);
+	} else if (!handle && handled)
+		sigaddset(&l->sigmask, signo);
+
+	lua_pushnil(L);
+	lua_pushfstring(L, "Error handling signal: %s", strerror(err));
+	return 2;
+}
+
+/*
+ * Milliseconds until the loop needs to run again,
+ * 0 if there are messages to dispatch already and
+ * -1 if only events on the epoll fd will do
+ */
+static int next_timeout(simpledbus_loop *l)
+{
+	unsigned int i;
+
+	for (i = 0; i < l->nconns; i++) {
+		if (dbus_connection_get_dispatch_status(l->conns[i]->conn)
+				== DBUS_DISPATCH_DATA_REMAINS)
+			return 0;
+	}
+
+	return timer_next(&l->wheel);
+}
+
+static int drained(simpledbus_loop *l, uint64_t now)
+{
+	unsigned int i;
+
+	if (now >= l->deadline)
+		return 1;
+
+	for (i = 0; i < l->nconns; i++) {
+		LCon *c = l->conns[i];
+
+		if (c->ncalls || dbus_connection_has_messages_to_send(c->conn))
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Keep running the loop after drain() until every call has been
+ * answered and all messages are sent or the deadline is reached.
+ * Calls still waiting are then cancelled, and every connection
+ * is flushed. A plain stop() leaves the calls in flight, so they
+ * can still be answered when the loop is started again.
+ */
+static void drain(simpledbus_loop *l)
+{
+	unsigned int i;
+
+	if (!l->draining)
+		return;
+
+	while (l->draining) {
+		uint64_t now = timer_now();
+		int timeout;
+
+		if (drained(l, now))
+			break;
+
+		timeout = next_timeout(l);
+		if (timeout < 0 || (uint64_t)timeout > l->deadline - now)
+			timeout = (int)(l->deadline - now);
+
+		if (handleall(l, timeout) < 0)
+			break;
+
+		timer_run(&l->wheel);
+		dispatchall(l);
+	}
+
+	l->draining = 0;
+
+	for (i = 0; i < l->nconns; i++) {
+		LCon *c = l->conns[i];
+		struct call *calls = c->calls;
+
+		/* the threads resumed may make new calls,
+		 * so only cancel the ones waiting now */
+		c->calls = NULL;
+		if (calls)
+			calls->pprev = &calls;
+		while (calls)
+			call_cancel(calls, "Call cancelled");
+
+		dbus_connection_flush(c->conn);
+	}
+}
+
+static int simpledbus_mainloop(lua_State *L)
+{
+	simpledbus_loop *l = loop_get(L);
+	LCon **c;
+	int i;
+	int n = lua_gettop(L);
+
+	if (l->mainThread)
+		return luaL_error(L, "Another main loop is already running");
+
+	if (lua_isfunction(L, n))
+		n--;
+
+	if (n < 1)
+		return luaL_error(L, "At least 1 DBus connection required");
+
+	c = malloc(n * sizeof(LCon *));
+	if (c == NULL) {
 		lua_pushnil(L);
-		if (dbus_error_is_set(&err)) {
-			lua_pushstring(L, err.message);
-			dbus_error_free(&err);
-		} else
-			lua_pushliteral(L, "Reply null");
+		lua_pushliteral(L, "Out of memory");
 		return 2;
 	}
 
-	switch (dbus_message_get_type(ret)) {
-	case DBUS_MESSAGE_TYPE_METHOD_RETURN:
-		{
-			/* read the parameters */
-			int nargs = push_arguments(L, ret);
-			dbus_message_unref(ret);
+	for (i = 0; i < n; i++) {
+		/* don't use bus_check() so we can free c
+		 * before erroring
+		c[i] = bus_check(L, i+1);
+		*/
+		int r;
 
-			return nargs;
+		if (lua_getmetatable(L, i+1) == 0) {
+			free(c);
+			return luaL_argerror(L, i+1,
+					"expected a DBus connection");
 		}
-	case DBUS_MESSAGE_TYPE_ERROR:
+
+		r = lua_equal(L, lua_upvalueindex(1), -1);
+		lua_pop(L, 1);
+		if (r == 0) {
+			free(c);
+			return luaL_argerror(L, i+1,
+					"expected a DBus connection");
+		}
+
+		c[i] = lua_touserdata(L, i+1);
+	}
+
+	for (i = 0; i < n; i++) {
+		if (attach(c[i])) {
+			while (i--)
+				detach(c[i]);
+			free(c);
+			lua_pushnil(L);
+			lua_pushliteral(L, "Out of memory");
+			return 2;
+		}
+	}
+
+	l->stop = 0;
+	l->mainThread = L;
+
+	/* read, write and dispatch what is ready now, but only once,
+	 * since watched fds that stay readable would keep the start
+	 * function from ever running */
+	dispatchall(l);
+	if (l->stop)
+		goto exit;
+
+	if (handleall(l, 0) < 0) {
 		lua_pushnil(L);
-		dbus_set_error_from_message(&err, ret);
-		lua_pushstring(L, err.message);
-		dbus_error_free(&err);
-		dbus_message_unref(ret);
-		return 2;
+		lua_pushfstring(L, "Error polling DBus: %s",
+				strerror(errno));
+		l->stop = 2;
+		goto exit;
 	}
 
-	dbus_message_unref(ret);
+	dispatchall(l);
+	if (l->stop)
+		goto exit;
 
-	lua_pushnil(L);
-	lua_pushliteral(L, "Unknown reply");
-	return 2;
-}
+	/* if the last argument was a function,
+	 * start it in a new thread */
+	if (n < lua_gettop(L)) {
+		lua_State *T = lua_newthread(L);
+		lua_insert(L, n+1);
+		lua_xmove(L, T, 1);
 
-/* this magic string representation of an incoming
- * signal must match the one in the Lua code */
-#define push_signal_string(L, object, interface, signal) \
-	lua_pushfstring(L, "%s\n%s\n%s", object, interface, signal)
+		switch (lua_resume(T, 0)) {
+		case 0: /* thread finished */
+		case LUA_YIELD:	/* thread yielded */
+			/* forget about the thread */
+			lua_settop(L, n);
+			break;
+		default: /* thread errored */
+			/* move error message to main thread */
+			lua_xmove(T, L, 1);
+			l->stop = -1;
+			goto exit;
+		}
+	}
 
-static DBusHandlerResult signal_handler(DBusConnection *conn,
-		DBusMessage *msg, lua_State *S)
-{
-	lua_State *T;
+	/* now run the real main loop */
+	while (1) {
+		dispatchall(l);
 
-	if (msg == NULL || dbus_message_get_type(msg)
-			!= DBUS_MESSAGE_TYPE_SIGNAL)
-		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+		if (l->stop)
+			break;
 
-	push_signal_string(S,
-			dbus_message_get_path(msg),
-			dbus_message_get_interface(msg),
-			dbus_message_get_member(msg));
-#ifdef DEBUG
-	printf("received \"%s\"\n", lua_tostring(S, 2));
-	fflush(stdout);
-#endif
-	lua_rawget(S, 1); /* signal handler table */
-	if (lua_type(S, 2) != LUA_TFUNCTION) {
-		lua_settop(S, 1);
-		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+		if (handleall(l, next_timeout(l)) < 0) {
+			lua_pushnil(L);
+			lua_pushfstring(L, "Error polling DBus: %s",
+					strerror(errno));
+			l->stop = 2;
+			break;
+		}
+
+		timer_run(&l->wheel);
 	}
 
-	/* create new Lua thread */
-	T = lua_newthread(S);
-	lua_insert(S, 2);
-	/* push nil to let whoever sees the end of this thread
-	 * know that nothing further needs to be done */
-	lua_pushnil(T);
-	/* move the Lua signal handler there */
-	lua_xmove(S, T, 1);
+exit:
+	if (l->stop > 0)
+		drain(l);
 
-	switch (lua_resume(T, push_arguments(T, msg))) {
-	case 0: /* thread finished */
-	case LUA_YIELD:	/* thread yielded */
-		/* just forget about it */
-		lua_settop(S, 1);
-		break;
-	default: /* thread errored */
-		lua_settop(S, 1);
-		if (stop == 0) {
-			/* move error message to main */
-			lua_xmove(T, mainThread, 1);
-			stop = -1;
+	for (i = 0; i < n; i++)
+		detach(c[i]);
+
+	free(c);
+
+	l->mainThread = NULL;
+
+	if (l->stop < 0)
+		return lua_error(L);
+
+	return l->stop;
+}
+
+/*
+ * step()
+ *
+ * argument 1: timeout in milliseconds (optional)
+ *
+ * Runs a single iteration of the loop, waiting at most timeout
+ * milliseconds (default 0, negative means forever) for something
+ * to happen. If stop() was called the values passed to it are
+ * returned.
+ */
+static int simpledbus_step(lua_State *L)
+{
+	int timeout = luaL_optint(L, 1, 0);
+	simpledbus_loop *l = loop_get(L);
+	int next;
+
+	if (l->mainThread)
+		return luaL_error(L, "Another main loop is already running");
+
+	lua_settop(L, 0);
+
+	l->stop = 0;
+	l->mainThread = L;
+
+	dispatchall(l);
+
+	if (l->stop == 0) {
+		next = next_timeout(l);
+		if (next >= 0 && (timeout < 0 || next < timeout))
+			timeout = next;
+
+		if (handleall(l, timeout) < 0) {
+			lua_pushnil(L);
+			lua_pushfstring(L, "Error polling DBus: %s",
+					strerror(errno));
+			l->stop = 2;
+		} else {
+			timer_run(&l->wheel);
+
+			if (l->stop == 0)
+				dispatchall(l);
 		}
 	}
 
-	return DBUS_HANDLER_RESULT_HANDLED;
+	if (l->stop > 0)
+		drain(l);
+
+	l->mainThread = NULL;
+
+	if (l->stop < 0)
+		return lua_error(L);
+
+	return l->stop;
+}
+
+/*
+ * get_fd()
+ *
+ * Returns the epoll file descriptor of the loop. It becomes readable
+ * when step() has something to do, so it can be watched by another
+ * event loop.
+ */
+static int simpledbus_get_fd(lua_State *L)
+{
+	lua_pushinteger(L, loop_get(L)->epfd);
+	return 1;
+}
+
+/*
+ * timeout()
+ *
+ * Returns the number of milliseconds until step() must be called
+ * even if the file descriptor isn't readable, or nil if there are
+ * no timers.
+ */
+static int simpledbus_timeout(lua_State *L)
+{
+	int timeout = next_timeout(loop_get(L));
+
+	if (timeout < 0)
+		lua_pushnil(L);
+	else
+		lua_pushinteger(L, timeout);
+	return 1;
+}
+
+/*
+ * Bus:get_fd()
+ *
+ * argument 1: bus
+ *
+ * Attaches the connection to the loop for good, so it is serviced
+ * by step(), and returns the epoll file descriptor of the loop.
+ */
+static int bus_get_fd(lua_State *L)
+{
+	LCon *c = bus_check(L, 1);
+
+	lua_settop(L, 1);
+
+	if (connection_anchor(L, c, 1)) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "Out of memory");
+		return 2;
+	}
+
+	lua_pushinteger(L, c->w.loop->epfd);
+	return 1;
 }
 
 /*
- * Bus:send_signal()
+ * Bus:set_budget()
  *
- * argument 1: connection
- * argument 2: path
- * argument 3: interface
- * argument 4: name
- * argument 5: signature (optional)
- * ...
+ * argument 1: bus
+ * argument 2: messages dispatched per loop iteration, 0 for no limit
  */
-static int bus_send_signal(lua_State *L)
+static int bus_set_budget(lua_State *L)
 {
-	DBusConnection *conn = bus_check(L, 1)->conn;
-	const char *path = luaL_checkstring(L, 2);
-	const char *interface = luaL_checkstring(L, 3);
-	const char *name = luaL_checkstring(L, 4);
-	DBusMessage *msg;
-	dbus_bool_t r;
+	LCon *c = bus_check(L, 1);
+	int budget = luaL_checkint(L, 2);
 
-	if (interface && *interface == '\0')
-		interface = NULL;
+	if (budget < 0)
+		return luaL_argerror(L, 2, "budget must not be negative");
 
-	msg = dbus_message_new_signal(path, interface, name);
-	if (msg == NULL) {
-		lua_pushnil(L);
-		lua_pushliteral(L, "Out of memory");
-		return 2;
-	}
+	c->budget = (unsigned int)budget;
 
-	if (lua_isstring(L, 5)) {
-		const char *signature = lua_tostring(L, 5);
-		if (*signature &&
-				add_arguments(L, 6, lua_gettop(L), signature, msg))
-			return lua_error(L);
-	}
+	/* return true */
+	lua_pushboolean(L, 1);
+	return 1;
+}
 
-	r = dbus_connection_send(conn, msg, NULL);
-	dbus_message_unref(msg);
+/*
+ * Bus:is_peer()
+ *
+ * argument 1: bus
+ *
+ * Returns true if the connection isn't registered with a bus
+ * daemon, so there is no org.freedesktop.DBus to talk to.
+ */
+static int bus_is_peer(lua_State *L)
+{
+	LCon *c = bus_check(L, 1);
 
-	if (r == FALSE) {
-		lua_pushnil(L);
-		lua_pushliteral(L, "Out of memory");
-		return 2;
-	}
+	lua_pushboolean(L, dbus_bus_get_unique_name(c->conn) == NULL);
+	return 1;
+}
+
+/*
+ * Bus:attached()
+ *
+ * argument 1: bus
+ *
+ * Returns true while the bus is attached to the main loop, by
+ * mainloop() or get_fd(), so incoming messages are dispatched.
+ */
+static int bus_attached(lua_State *L)
+{
+	LCon *c = bus_check(L, 1);
+
+	lua_pushboolean(L, c->w.attached > 0);
+	return 1;
+}
+
+/*
+ * Bus:set_priority()
+ *
+ * argument 1: bus
+ * argument 2: priority
+ */
+static int bus_set_priority(lua_State *L)
+{
+	LCon *c = bus_check(L, 1);
+	int priority = luaL_checkint(L, 2);
+
+	if (c->w.attached && c->w.loop->dispatching) {
+		/* dispatchall() sorts it into place */
+		c->priority = priority;
+		c->w.loop->resort = 1;
+	} else if (c->w.attached) {
+		/* the connection can't move up without growing the
+		 * array, so there is always room to put it back */
+		conns_remove(c->w.loop, c);
+		c->priority = priority;
+		(void)conns_insert(c->w.loop, c);
+	} else
+		c->priority = priority;
 
 	/* return true */
 	lua_pushboolean(L, 1);
 	return 1;
 }
 
-static int send_reply(lua_State *T)
+/*
+ * Push a table with the count, mean, minimum, maximum
+ * and percentiles of a latency histogram
+ */
+static void push_hist(lua_State *L, const struct hist *h)
 {
-	DBusConnection *conn = lua_touserdata(T, 2);
-	DBusMessage *msg = lua_touserdata(T, 3);
-	DBusMessage *reply;
-	int top = lua_gettop(T);
+	lua_createtable(L, 0, 8);
+	lua_pushnumber(L, (lua_Number)h->count);
+	lua_setfield(L, -2, "count");
+	lua_pushnumber(L, h->count ? (lua_Number)h->sum /
+			(lua_Number)h->count : 0);
+	lua_setfield(L, -2, "mean");
+	lua_pushnumber(L, (lua_Number)h->min);
+	lua_setfield(L, -2, "min");
+	lua_pushnumber(L, (lua_Number)h->max);
+	lua_setfield(L, -2, "max");
+	lua_pushnumber(L, (lua_Number)hist_percentile(h, 0.5));
+	lua_setfield(L, -2, "p50");
+	lua_pushnumber(L, (lua_Number)hist_percentile(h, 0.9));
+	lua_setfield(L, -2, "p90");
+	lua_pushnumber(L, (lua_Number)hist_percentile(h, 0.99));
+	lua_setfield(L, -2, "p99");
+	lua_pushnumber(L, (lua_Number)hist_percentile(h, 0.999));
+	lua_setfield(L, -2, "p999");
+}
 
-	/* check if the method returned an error */
-	if (top >= 6 && lua_isnil(T, 5)) {
-		const char *name = lua_tostring(T, 6);
-		const char *message = (top >= 7) ? lua_tostring(T, 7) : NULL;
+/*
+ * Bus:dispatch_latency()
+ *
+ * argument 1: bus
+ * argument 2: reset (optional)
+ *
+ * Returns a table with the number of messages dispatched and
+ * the mean, minimum, maximum and percentile latencies in
+ * microseconds.
+ */
+static int bus_dispatch_latency(lua_State *L)
+{
+	LCon *c = bus_check(L, 1);
+	int reset = lua_toboolean(L, 2);
 
-		if (name == NULL) {
-			dbus_message_unref(msg);
-			lua_pushliteral(T, "Return #1 nil, "
-					"expected error name as #2");
-			return 1;
-		}
-		if (message && *message == '\0')
-			message = NULL;
+	push_hist(L, &c->latency);
 
-		reply = dbus_message_new_error(msg, name, message);
-		dbus_message_unref(msg);
-		if (reply == NULL) {
-			lua_pushliteral(T, "Out of memory");
-			return 1;
-		}
-	} else {
-		const char *signature;
+	if (reset)
+		hist_reset(&c->latency);
 
-		reply = dbus_message_new_method_return(msg);
-		dbus_message_unref(msg);
-		if (reply == NULL) {
-			lua_pushliteral(T, "Out of memory");
-			return 1;
-		}
+	return 1;
+}
 
-		signature = lua_tostring(T, 4);
-		if (signature && *signature &&
-				add_arguments(T, 5, top, signature, reply)) {
-			/* add_arguments() pushes its own error message */
-			dbus_message_unref(reply);
-			return 1;
+/*
+ * Push a table of the histograms in table t of the histogram
+ * thread H by interface.member, resetting them if asked to.
+ * The histograms are only reset, not removed, since calls
+ * in flight point to them.
+ */
+static void push_latencies(lua_State *L, lua_State *H, int t, int reset)
+{
+	lua_newtable(L);
+	lua_pushnil(H);
+	while (lua_next(H, t)) {
+		struct hist *h = lua_touserdata(H, -1);
+
+		if (h->count) {
+			lua_pushstring(L, lua_tostring(H, -2));
+			push_hist(L, h);
+			lua_rawset(L, -3);
 		}
+		if (reset)
+			hist_reset(h);
+		lua_pop(H, 1);
 	}
+}
 
-	if (!dbus_connection_send(conn, reply, NULL)) {
-		lua_pushliteral(T, "Out of memory");
-		return 1;
-	}
+/*
+ * Bus:latency()
+ *
+ * argument 1: bus
+ * argument 2: reset (optional)
+ *
+ * Returns a table with the latencies of the method calls made
+ * on the bus in the field calls and of the methods served in
+ * the field methods. Both are tables of latencies like the ones
+ * returned by dispatch_latency() by "interface.member".
+ * Calls are measured from when they're sent until the caller
+ * is resumed with the reply and served methods from when the
+ * call is received until the reply is sent.
+ */
+static int bus_latency(lua_State *L)
+{
+	LCon *c = bus_check(L, 1);
+	int reset = lua_toboolean(L, 2);
 
-	dbus_message_unref(reply);
+	lua_createtable(L, 0, 2);
+	push_latencies(L, c->H, 1, reset);
+	lua_setfield(L, -2, "calls");
+	push_latencies(L, c->H, 2, reset);
+	lua_setfield(L, -2, "methods");
 
-	return 0;
+	return 1;
 }
 
-static DBusHandlerResult method_call_handler(DBusConnection *conn,
-		DBusMessage *msg, lua_State *O)
+static void push_counts(lua_State *L, const uint64_t *n)
 {
-	lua_State *T;
+	lua_createtable(L, 0, 4);
+	lua_pushnumber(L, (lua_Number)n[DBUS_MESSAGE_TYPE_METHOD_CALL]);
+	lua_setfield(L, -2, "method_call");
+	lua_pushnumber(L, (lua_Number)n[DBUS_MESSAGE_TYPE_METHOD_RETURN]);
+	lua_setfield(L, -2, "method_return");
+	lua_pushnumber(L, (lua_Number)n[DBUS_MESSAGE_TYPE_ERROR]);
+	lua_setfield(L, -2, "error");
+	lua_pushnumber(L, (lua_Number)n[DBUS_MESSAGE_TYPE_SIGNAL]);
+	lua_setfield(L, -2, "signal");
+}
 
-#ifdef DEBUG
-	printf("Received message: path = %s,"
-			" interface = %s, member = %s\n",
-			dbus_message_get_path(msg),
-			dbus_message_get_interface(msg),
-			dbus_message_get_member(msg));
-	fflush(stdout);
-#endif
+/*
+ * Bus:stats()
+ *
+ * argument 1: bus
+ * argument 2: reset (optional)
+ *
+ * Returns a table with the messages sent and received by type,
+ * signals matched by the signal table or not, method calls served,
+ * calls waiting for a reply, bytes in the outgoing queue and the
+ * loop iterations and wakeups.
+ */
+static int bus_stats(lua_State *L)
+{
+	LCon *c = bus_check(L, 1);
+	simpledbus_loop *l = c->w.loop;
+	int reset = lua_toboolean(L, 2);
+
+	lua_createtable(L, 0, 9);
+	push_counts(L, c->stats.sent);
+	lua_setfield(L, -2, "sent");
+	push_counts(L, c->stats.received);
+	lua_setfield(L, -2, "received");
+	lua_pushnumber(L, (lua_Number)c->stats.signals_matched);
+	lua_setfield(L, -2, "signals_matched");
+	lua_pushnumber(L, (lua_Number)c->stats.signals_unmatched);
+	lua_setfield(L, -2, "signals_unmatched");
+	lua_pushnumber(L, (lua_Number)c->stats.methods_served);
+	lua_setfield(L, -2, "methods_served");
+	lua_pushnumber(L, (lua_Number)c->ncalls);
+	lua_setfield(L, -2, "pending_calls");
+	lua_pushnumber(L, (lua_Number)dbus_connection_get_outgoing_size(c->conn));
+	lua_setfield(L, -2, "outgoing_size");
+	lua_pushnumber(L, (lua_Number)l->iterations);
+	lua_setfield(L, -2, "loop_iterations");
+	lua_pushnumber(L, (lua_Number)l->wakeups);
+	lua_setfield(L, -2, "loop_wakeups");
+
+	if (reset)
+		memset(&c->stats, 0, sizeof(c->stats));
 
-	lua_pushfstring(O, "%s.%s",
-			dbus_message_get_interface(msg),
-			dbus_message_get_member(msg));
+	return 1;
+}
 
-	lua_rawget(O, 1);
-	if (!lua_istable(O, 2)) {
-		lua_settop(O, 1);
-#ifdef DEBUG
-		printf("..not handled\n"); fflush(stdout);
-#endif
-		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
-	}
+static int loop_stop(lua_State *L, simpledbus_loop *l)
+{
+	l->stop = lua_gettop(L);
 
-	/* create a new thread to run the method in */
-	T = lua_newthread(O);
-	/* ..and insert it before the function table */
-	lua_insert(O, 2);
+	if (l->stop == 0) {
+		lua_pushboolean(L, 1);
+		l->stop = 1;
+	}
 
-	/* push the send_reply function */
-	lua_pushcclosure(T, send_reply, 0);
+	lua_checkstack(l->mainThread, l->stop);
 
-	/* push the connection */
-	lua_pushlightuserdata(T, conn);
+	lua_xmove(L, l->mainThread, l->stop);
 
-	/* push the message */
-	dbus_message_ref(msg);
-	lua_pushlightuserdata(T, msg);
+	return 0;
+}
 
-	/* move the return signature and the function to T */
-	lua_rawgeti(O, 3, 2);
-	lua_rawgeti(O, 3, 3);
-	lua_xmove(O, T, 2);
+/*
+ * stop()
+ *
+ * Stopping while draining stops right away.
+ */
+static int simpledbus_stop(lua_State *L)
+{
+	simpledbus_loop *l = loop_get(L);
 
-	/* forget about the function table */
-	lua_settop(O, 2);
+	if (l->mainThread == NULL)
+		return luaL_error(L, "Main loop not running");
 
-	switch (lua_resume(T, push_arguments(T, msg))) {
-	case 0: /* thread finished */
-		if (send_reply(T) && stop == 0) {
-			/* move error message to main thread and error */
-			lua_xmove(T, mainThread, 1);
-			stop = -1;
-		}
-	case LUA_YIELD:	/* thread yielded */
-		/* forget about the thread */
-		lua_settop(O, 1);
-		break;
-	default: /* thread errored */
-		lua_settop(O, 1);
-		if (stop == 0) {
-			/* move error message to main */
-			lua_xmove(T, mainThread, 1);
-			stop = -1;
-		}
+	if (l->stop > 0) {
+		l->draining = 0;
+		return 0;
 	}
 
-	return DBUS_HANDLER_RESULT_HANDLED;
+	return loop_stop(L, l);
 }
 
 /*
- * Bus:register_object_path()
+ * drain()
  *
- * argument 1: connection
- * argument 2: path
- * argument 3: method table
+ * argument 1: milliseconds
+ * ...
+ *
+ * Stops the main loop like stop() with the rest of the arguments,
+ * but first waits at most the given milliseconds for replies to
+ * the calls in flight and for outgoing messages to be sent.
+ * Calls not answered by then return nil, "Call cancelled".
  */
-static int bus_register_object_path(lua_State *L)
+static int simpledbus_drain(lua_State *L)
 {
-	LCon *c = bus_check(L, 1);
-	const char *path = luaL_checkstring(L, 2);
-	lua_State *O;
+	lua_Number ms = luaL_checknumber(L, 1);
+	simpledbus_loop *l = loop_get(L);
 
-	luaL_checktype(L, 3, LUA_TTABLE);
+	if (l->mainThread == NULL)
+		return luaL_error(L, "Main loop not running");
 
-	/* drop extra arguments */
-	lua_settop(L, 3);
+	if (l->stop)
+		return 0;
 
-	/* get the signal/thread table of the conection */
-	lua_getfenv(L, 1);
-	/* ..and move it before the path */
-	lua_insert(L, 2);
+	if (ms < 0)
+		ms = 0;
 
-	/* check if we already registered this object path */
-	lua_pushvalue(L, 3);
-	lua_rawget(L, 2);
-	if (lua_isthread(L, 5)) {
-		/* just replace the method table */
-		O = lua_tothread(L, 5);
-		lua_xmove(L, O, 1);
-		lua_replace(O, 2);
-		/* return true */
-		lua_pushboolean(L, 1);
-		return 1;
+	l->draining = 1;
+	l->deadline = timer_now() + (uint64_t)ms;
+
+	lua_remove(L, 1);
+	return loop_stop(L, l);
+}
+
+static int new_connection(lua_State *L, DBusConnection *conn,
+		int private, DBusError *err)
+{
+	LCon *c;
+	lua_State *S;
+	const char *msg;
+
+	if (dbus_error_is_set(err)) {
+		lua_pushnil(L);
+		lua_pushstring(L, err->message);
+		dbus_error_free(err);
+		return 2;
 	}
-	/* clear result of lua_rawget() */
-	lua_settop(L, 4);
 
-	/* move method table before path */
-	lua_insert(L, 3);
+	if (conn == NULL) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "Couldn't create connection");
+		return 2;
+	}
+
+	dbus_connection_set_exit_on_disconnect(conn, FALSE);
+
+	lua_pushlightuserdata(L, conn);
+	lua_rawget(L, lua_upvalueindex(2)); /* connection table */
+	if (lua_type(L, -1) == LUA_TUSERDATA) {
+		dbus_connection_unref(conn);
+		return 1;
+	} else
+		lua_settop(L, 0);
+
+	/* create new userdata for the bus */
+	c = lua_newuserdata(L, sizeof(LCon));
+	if (c == NULL) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "Out of memory");
+		return 2;
+	}
+	watchset_init(&c->w, loop_get(L), connection_ready);
+	c->conn = conn;
+	c->installed = 0;
+	c->index = 0;
+	c->anchored = 0;
+	c->disconnected = 0;
+	c->private = private;
+	c->bus_type = -1;
+	c->address = NULL;
+	c->reconnect = 0;
+	c->priority = 0;
+	c->budget = DEFAULT_BUDGET;
+	c->ready_at = 0;
+	hist_reset(&c->latency);
+	c->calls = NULL;
+	c->ncalls = 0;
+	memset(&c->stats, 0, sizeof(c->stats));
+
+	/* set the metatable */
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_setmetatable(L, 1);
 
-	/* create thread for storing object data */
-	O = lua_newthread(L);
-	if (O == NULL) {
+	/* create new environment table for
+	 * signal handlers and running threads */
+	lua_createtable(L, 3, 0);
+	lua_pushvalue(L, 2);
+	lua_setfenv(L, 1);
+
+	/* create thread for signal handler */
+	S = lua_newthread(L);
+	if (S == NULL) {
 		lua_pushnil(L);
 		lua_pushliteral(L, "Out of memory");
 		return 2;
 	}
+	/* ..and save it */
+	lua_rawseti(L, 2, 1);
 
-	/* register the object path */
-	if (!dbus_connection_register_object_path(c->conn, path, &vtable, O)) {
+	/* create signal table */
+	lua_newtable(L);
+	/* ..save it */
+	lua_pushvalue(L, 3);
+	lua_rawseti(L, 2, 2);
+	/* ..and move it to the thread */
+	lua_xmove(L, S, 1);
+	/* no owner hook yet */
+	lua_pushnil(S);
+
+	c->S = S;
+
+	/* create thread for the latency histograms
+	 * of calls and methods served */
+	c->H = lua_newthread(L);
+	if (c->H == NULL) {
 		lua_pushnil(L);
 		lua_pushliteral(L, "Out of memory");
 		return 2;
 	}
+	lua_rawseti(L, 2, 3);
+	lua_newtable(c->H);
+	lua_newtable(c->H);
 
-	/* save the thread in the thread table */
-	lua_rawset(L, 2);
+	/* the connection is released when the bus is collected */
+	msg = connection_install(c);
+	if (msg) {
+		lua_pushnil(L);
+		lua_pushstring(L, msg);
+		return 2;
+	}
 
-	/* move method table to the thread*/
-	lua_xmove(L, O, 1);
+	/* insert the connection in the connection table */
+	lua_pushlightuserdata(L, conn);
+	lua_pushvalue(L, 1);
+	lua_rawset(L, lua_upvalueindex(2));
 
-	/* return true */
-	lua_pushboolean(L, 1);
+	/* return the connection */
+	lua_settop(L, 1);
 	return 1;
 }
 
 /*
- * Bus:unregister_object_path()
- *
- * argument 1: connection
- * argument 2: path
+ * Shared connections are shared by everything in the process, so
+ * Lua states running their loops in different threads must ask for
+ * private connections.
  */
-static int bus_unregister_object_path(lua_State *L)
+static int bus_get(lua_State *L, DBusBusType type)
 {
-	LCon *c = bus_check(L, 1);
-	const char *path = luaL_checkstring(L, 2);
-
-	/* drop extra arguments */
-	lua_settop(L, 2);
-
-	/* get the signal/thread table of the conection */
-	lua_getfenv(L, 1);
-	/* ..and move it before the path */
-	lua_insert(L, 2);
-
-	lua_pushvalue(L, 3);
-	lua_rawget(L, 2);
-	if (!lua_isthread(L, 4))
-		return luaL_error(L, "Object path not registered");
-	lua_settop(L, 3);
+	int private = lua_toboolean(L, 1);
+	DBusError err;
+	int r;
 
-	lua_pushnil(L);
-	if (!dbus_connection_unregister_object_path(c->conn, path)) {
-		lua_pushliteral(L, "Out of memory");
-		return 2;
-	}
+	dbus_error_init(&err);
+	r = new_connection(L, private ?
+			dbus_bus_get_private(type, &err) :
+			dbus_bus_get(type, &err), private, &err);
 
-	lua_rawset(L, 2);
+	/* remember the bus for reconnecting */
+	if (r == 1)
+		((LCon *)lua_touserdata(L, -1))->bus_type = type;
 
-	/* return true */
-	lua_pushboolean(L, 1);
-	return 1;
+	return r;
 }
 
 /*
- * DBus.__gc()
+ * SessionBus()
+ *
+ * argument 1: private (optional)
  */
-static int bus_gc(lua_State *L)
+static int simpledbus_session_bus(lua_State *L)
 {
-	LCon *c = lua_touserdata(L, 1);
-	dbus_connection_unref(c->conn);
-
-	return 0;
+	return bus_get(L, DBUS_BUS_SESSION);
 }
 
 /*
- * mainloop()
+ * SystemBus()
+ *
+ * argument 1: private (optional)
  */
-static struct pollfd *make_poll_struct(int n, LCon **c, nfds_t *nfds)
-{
-	struct pollfd *p;
-	struct pollfd *fds;
-	nfds_t total = 0;
-	int i;
-	DBusWatch *watch;
-
-	for (i = 0; i < n; i++)
-		total += c[i]->nactive;
-	*nfds = total;
-
-	fds = malloc(total * sizeof(struct pollfd));
-	if (fds == NULL)
-		return NULL;
-
-	p = fds;
-	for (i = 0; i < n; i++) {
-		for (watch = c[i]->active; watch;
-				watch = dbus_watch_get_data(watch)) {
-			unsigned int flags = dbus_watch_get_flags(watch);
-
-			p->fd = dbus_watch_get_unix_fd(watch);
-			p->events = POLLERR | POLLHUP;
-			p->revents = 0;
-
-			if (flags & DBUS_WATCH_READABLE)
-				p->events |= POLLIN;
-			if (flags & DBUS_WATCH_WRITABLE)
-				p->events |= POLLOUT;
-
-			p++;
-		}
-
-		c[i]->watches_changed = 0;
-	}
-
-	return fds;
-}
-
-static inline unsigned int dispatchall(int n, LCon **c)
+static int simpledbus_system_bus(lua_State *L)
 {
-	unsigned int r;
-	int i;
-
-	for (i = 0; i < n; i++) {
-		DBusConnection *conn = c[i]->conn;
-
-		if (dbus_connection_get_dispatch_status(conn)
-				== DBUS_DISPATCH_DATA_REMAINS) {
-			while (dbus_connection_dispatch(conn)
-					== DBUS_DISPATCH_DATA_REMAINS);
-		}
-
-		r |= c[i]->watches_changed;
-	}
-
-	return r;
+	return bus_get(L, DBUS_BUS_SYSTEM);
 }
 
-static inline void handleall(int n, LCon **c, struct pollfd *p)
+/*
+ * StarterBus()
+ *
+ * argument 1: private (optional)
+ */
+static int simpledbus_starter_bus(lua_State *L)
 {
-	int i;
-	DBusWatch *watch;
-
-	for (i = 0; i < n; i++) {
-		for (watch = c[i]->active; watch;
-				watch = dbus_watch_get_data(watch)) {
-			if (p->revents) {
-				unsigned int flags = 0;
-
-				if (p->revents & POLLIN)
-					flags |= DBUS_WATCH_READABLE;
-				if (p->revents & POLLOUT)
-					flags |= DBUS_WATCH_WRITABLE;
-				if (p->revents & POLLERR)
-					flags |= DBUS_WATCH_ERROR;
-				if (p->revents & POLLHUP)
-					flags |= DBUS_WATCH_HANGUP;
-
-				(void)dbus_watch_handle(watch, flags);
-				p->revents = 0;
-			}
-			p++;
-		}
-	}
+	return bus_get(L, DBUS_BUS_STARTER);
 }
 
-static int simpledbus_mainloop(lua_State *L)
+/*
+ * open()
+ *
+ * argument 1: address
+ * argument 2: private (optional)
+ */
+static int simpledbus_open(lua_State *L)
 {
-	LCon **c;
-	struct pollfd *fds;
-	nfds_t nfds;
-	int i;
-	int n = lua_gettop(L);
-
-	if (mainThread)
-		return luaL_error(L, "Another main loop is already running");
-
-	if (lua_isfunction(L, n))
-		n--;
-
-	if (n < 1)
-		return luaL_error(L, "At least 1 DBus connection required");
+	const char *address = luaL_checkstring(L, 1);
+	int private = lua_toboolean(L, 2);
+	char *copy = strdup(address);
+	DBusError err;
+	LCon *c;
+	int r;
 
-	c = malloc(n * sizeof(LCon *));
-	if (c == NULL) {
+	if (copy == NULL) {
 		lua_pushnil(L);
 		lua_pushliteral(L, "Out of memory");
 		return 2;
 	}
 
-	for (i = 0; i < n; i++) {
-		/* don't use bus_check() so we can free c
-		 * before erroring
-		c[i] = bus_check(L, i+1);
-		*/
-		int r;
+	dbus_error_init(&err);
+	r = new_connection(L, private ?
+			dbus_connection_open_private(copy, &err) :
+			dbus_connection_open(copy, &err), private, &err);
+
+	/* remember the address for reconnecting */
+	c = lua_touserdata(L, -1);
+	if (r == 1 && c->address == NULL)
+		c->address = copy;
+	else
+		free(copy);
 
-		if (lua_getmetatable(L, i+1) == 0) {
-			free(c);
-			return luaL_argerror(L, i+1,
-					"expected a DBus connection");
-		}
+	return r;
+}
 
-		r = lua_equal(L, lua_upvalueindex(1), -1);
-		lua_pop(L, 1);
-		if (r == 0) {
-			free(c);
-			return luaL_argerror(L, i+1,
-					"expected a DBus connection");
-		}
+/*
+ * Bus:reconnect()
+ *
+ * upvalue 1: Bus
+ * upvalue 2: connection table
+ *
+ * argument 1: bus
+ */
+static int bus_reconnect(lua_State *L)
+{
+	LCon *c = bus_check(L, 1);
+	DBusConnection *conn;
+	int private = c->private;
+	const char *msg;
+	DBusError err;
 
-		c[i] = lua_touserdata(L, i+1);
+	lua_settop(L, 1);
+
+	if (c->installed && dbus_connection_get_is_connected(c->conn)) {
+		lua_pushboolean(L, 1);
+		return 1;
 	}
 
-	fds = make_poll_struct(n, c, &nfds);
-	if (fds == NULL) {
-		free(c);
+	dbus_error_init(&err);
+	if (c->bus_type >= 0)
+		conn = private ?
+			dbus_bus_get_private(c->bus_type, &err) :
+			dbus_bus_get(c->bus_type, &err);
+	else if (c->address)
+		conn = private ?
+			dbus_connection_open_private(c->address, &err) :
+			dbus_connection_open(c->address, &err);
+	else {
 		lua_pushnil(L);
-		lua_pushliteral(L, "Out of memory");
+		lua_pushliteral(L, "Peer connections can't be reconnected");
 		return 2;
 	}
 
-	stop = 0;
-	mainThread = L;
-
-	/* read, write, dispatch until we get a break */
-	while (1) {
-		unsigned int watches_changed = dispatchall(n, c);
-		int r;
+	if (conn == NULL) {
+		lua_pushnil(L);
+		if (dbus_error_is_set(&err)) {
+			lua_pushstring(L, err.message);
+			dbus_error_free(&err);
+		} else
+			lua_pushliteral(L, "Couldn't create connection");
+		return 2;
+	}
 
-		if (stop)
-			goto exit;
+	/* we got our own connection back, because
+	 * hooking it up failed the last time */
+	if (conn == c->conn) {
+		dbus_connection_unref(conn);
+		goto install;
+	}
 
-		if (watches_changed) {
-			free(fds);
-			fds = make_poll_struct(n, c, &nfds);
-			if (fds == NULL) {
-				free(c);
-				mainThread = NULL;
+	/* a shared connection may already be used by another
+	 * bus, so use a private one instead of sharing it */
+	if (!private) {
+		lua_pushlightuserdata(L, conn);
+		lua_rawget(L, lua_upvalueindex(2));
+		if (!lua_isnil(L, -1)) {
+			dbus_connection_unref(conn);
+			conn = c->bus_type >= 0 ?
+				dbus_bus_get_private(c->bus_type, &err) :
+				dbus_connection_open_private(c->address, &err);
+			if (conn == NULL) {
 				lua_pushnil(L);
-				lua_pushliteral(L, "Out of memory");
+				if (dbus_error_is_set(&err)) {
+					lua_pushstring(L, err.message);
+					dbus_error_free(&err);
+				} else
+					lua_pushliteral(L,
+						"Couldn't create connection");
 				return 2;
 			}
+			private = 1;
 		}
-		r = poll(fds, nfds, 0);
-		if (r < 0) {
-			lua_pushnil(L);
-			lua_pushfstring(L, "Error polling DBus: %s",
-					strerror(errno));
-			stop = 2;
-			goto exit;
-		}
-		if (r == 0)
-			break;
-
-		handleall(n, c, fds);
+		lua_settop(L, 1);
 	}
 
-	/* if the last argument was a function,
-	 * start it in a new thread */
-	if (n < lua_gettop(L)) {
-		lua_State *T = lua_newthread(L);
-		lua_insert(L, n+1);
-		lua_xmove(L, T, 1);
+	dbus_connection_set_exit_on_disconnect(conn, FALSE);
 
-		switch (lua_resume(T, 0)) {
-		case 0: /* thread finished */
-		case LUA_YIELD:	/* thread yielded */
-			/* forget about the thread */
-			lua_settop(L, n);
-			break;
-		default: /* thread errored */
-			/* move error message to main thread */
-			lua_xmove(T, L, 1);
-			stop = -1;
-			goto exit;
-		}
-	}
+	/* libdbus failed the calls in flight when the
+	 * connection was lost, but don't leave any behind */
+	while (c->calls)
+		call_cancel(c->calls, "Disconnected");
 
-	/* now run the real main loop */
-	while (1) {
-		unsigned int watches_changed = dispatchall(n, c);
+	/* let go of the old connection */
+	connection_uninstall(c);
 
-		if (stop)
-			break;
+	lua_pushlightuserdata(L, c->conn);
+	lua_pushnil(L);
+	lua_rawset(L, lua_upvalueindex(2));
 
-		if (watches_changed) {
-			free(fds);
-			fds = make_poll_struct(n, c, &nfds);
-			if (fds == NULL) {
-				free(c);
-				mainThread = NULL;
-				lua_pushnil(L);
-				lua_pushliteral(L, "Out of memory");
-				return 2;
-			}
-		}
-		if (poll(fds, nfds, -1) < 0) {
+	if (c->private)
+		dbus_connection_close(c->conn);
+	dbus_connection_unref(c->conn);
+
+	/* ..and use the new one */
+	c->conn = conn;
+	c->private = private;
+	c->disconnected = 0;
+	c->ready_at = 0;
+
+	lua_pushlightuserdata(L, conn);
+	lua_pushvalue(L, 1);
+	lua_rawset(L, lua_upvalueindex(2));
+
+	/* if this fails, calling reconnect() again tries again */
+install:
+	msg = connection_install(c);
+	if (msg) {
+		lua_pushnil(L);
+		lua_pushstring(L, msg);
+		return 2;
+	}
+
+	/* register the object paths again */
+	lua_getfenv(L, 1);
+	lua_pushnil(L);
+	while (lua_next(L, 2)) {
+		if (lua_type(L, -2) == LUA_TSTRING && lua_isthread(L, -1) &&
+				!dbus_connection_register_object_path(conn,
+					lua_tostring(L, -2), &vtable,
+					lua_tothread(L, -1))) {
 			lua_pushnil(L);
-			lua_pushfstring(L, "Error polling DBus: %s",
-					strerror(errno));
-			stop = 2;
-			break;
+			lua_pushliteral(L, "Out of memory");
+			return 2;
 		}
-		handleall(n, c, fds);
+		lua_pop(L, 1);
 	}
 
-exit:
-	free(c);
-	free(fds);
-
-	mainThread = NULL;
-
-	if (stop < 0)
-		return lua_error(L);
-
-	return stop;
+	/* return true */
+	lua_pushboolean(L, 1);
+	return 1;
 }
 
 /*
- * stop()
+ * Bus:set_reconnect()
+ *
+ * argument 1: bus
+ * argument 2: function called with the bus in a new thread
+ *             when it's disconnected, or nil
  */
-static int simpledbus_stop(lua_State *L)
+static int bus_set_reconnect(lua_State *L)
 {
-	if (mainThread == NULL)
-		return luaL_error(L, "Main loop not running");
+	LCon *c = bus_check(L, 1);
 
-	stop = lua_gettop(L);
+	if (!lua_isnoneornil(L, 2))
+		luaL_checktype(L, 2, LUA_TFUNCTION);
+	lua_settop(L, 2);
 
-	if (stop == 0) {
-		lua_pushboolean(L, 1);
-		stop = 1;
+	/* get the callback table */
+	lua_pushlightuserdata(L, &callbacks_key);
+	lua_rawget(L, LUA_REGISTRYINDEX);
+
+	if (lua_isfunction(L, 2)) {
+		/* anchor the bus with the function, so it's
+		 * there for the loop when the connection is lost */
+		anchor(L, 3, 1, 2);
+		c->reconnect = 1;
+	} else if (c->reconnect) {
+		if (c->anchored) {
+			lua_pushboolean(L, 1);
+			anchor(L, 3, 1, 4);
+		} else
+			unanchor(L, 3, 1);
+		c->reconnect = 0;
 	}
 
-	lua_checkstack(mainThread, stop);
+	/* return true */
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/*
+ * Peer-to-peer servers
+ */
+typedef struct {
+	struct watchset w;
+	DBusServer *server;
+} LServer;
 
-	lua_xmove(L, mainThread, stop);
+static void server_ready(struct source *s, uint32_t events)
+{
+	(void)watchset_handle((struct watchset *)s, events);
+}
 
-	return 0;
+/*
+ * Wrap a new peer connection in a Bus object
+ *
+ * upvalue 1: Bus
+ * upvalue 2: connection table
+ *
+ * argument 1: the connection as light userdata
+ */
+static int server_wrap(lua_State *L)
+{
+	DBusConnection *conn = lua_touserdata(L, 1);
+	DBusError err;
+
+	dbus_error_init(&err);
+	return new_connection(L, dbus_connection_ref(conn), 1, &err);
 }
 
-static int new_connection(lua_State *L, DBusConnection *conn)
+static void server_new_connection(DBusServer *server,
+		DBusConnection *conn, LServer *ls)
 {
+	lua_State *S = callback_get(ls->w.loop, ls);
 	LCon *c;
-	lua_State *S;
 
-	if (dbus_error_is_set(&err)) {
-		lua_pushnil(L);
-		lua_pushstring(L, err.message);
-		dbus_error_free(&err);
-		return 2;
+	(void)server;
+
+	/* call the wrapper in the environment of the server */
+	lua_getfenv(S, 2);
+	lua_rawgeti(S, 4, 1);
+	lua_remove(S, 4);
+	lua_pushlightuserdata(S, conn);
+	if (lua_pcall(S, 1, 1, 0) || lua_type(S, 4) != LUA_TUSERDATA) {
+		/* refuse the connection */
+		dbus_connection_close(conn);
+		lua_settop(S, 1);
+		return;
 	}
 
-	if (conn == NULL) {
-		lua_pushnil(L);
-		lua_pushliteral(L, "Couldn't create connection");
-		return 2;
+	/* poll the connection until it's disconnected */
+	c = lua_touserdata(S, 4);
+	if (connection_anchor(S, c, 4)) {
+		dbus_connection_close(conn);
+		lua_settop(S, 1);
+		return;
 	}
 
-	dbus_connection_set_exit_on_disconnect(conn, FALSE);
+	/* call the function with the new connection */
+	callback_start(S);
+	lua_settop(S, 1);
+}
 
-	lua_pushlightuserdata(L, conn);
-	lua_rawget(L, lua_upvalueindex(2)); /* connection table */
-	if (lua_type(L, -1) == LUA_TUSERDATA) {
-		dbus_connection_unref(conn);
-		return 1;
-	} else
-		lua_settop(L, 0);
+static LServer *server_check(lua_State *L, int index)
+{
+	int r;
 
-	/* create new userdata for the bus */
-	c = lua_newuserdata(L, sizeof(LCon));
-	if (c == NULL) {
-		lua_pushnil(L);
-		lua_pushliteral(L, "Out of memory");
-		return 2;
-	}
-	c->conn = conn;
-	c->nactive = 0;
-	c->active = NULL;
+	if (lua_getmetatable(L, index) == 0)
+		luaL_argerror(L, index, "expected a server");
 
-	/* set the metatable */
-	lua_pushvalue(L, lua_upvalueindex(1));
-	lua_setmetatable(L, 1);
+	r = lua_equal(L, lua_upvalueindex(1), -1);
+	lua_pop(L, 1);
+	if (r == 0)
+		luaL_argerror(L, index, "expected a server");
 
-	/* create new environment table for
-	 * signal handlers and running threads */
-	lua_createtable(L, 2, 0);
-	lua_pushvalue(L, 2);
-	lua_setfenv(L, 1);
+	return (LServer *)lua_touserdata(L, index);
+}
 
-	/* create thread for signal handler */
-	S = lua_newthread(L);
-	if (S == NULL) {
+/*
+ * listen()
+ *
+ * upvalue 1: Server
+ * upvalue 2: Bus
+ * upvalue 3: connection table
+ *
+ * argument 1: address
+ * argument 2: function called with each new peer connection
+ */
+static int simpledbus_listen(lua_State *L)
+{
+	const char *address = luaL_checkstring(L, 1);
+	DBusServer *server;
+	LServer *ls;
+	DBusError err;
+
+	luaL_checktype(L, 2, LUA_TFUNCTION);
+	lua_settop(L, 2);
+
+	dbus_error_init(&err);
+	server = dbus_server_listen(address, &err);
+	if (server == NULL) {
 		lua_pushnil(L);
-		lua_pushliteral(L, "Out of memory");
+		if (dbus_error_is_set(&err)) {
+			lua_pushstring(L, err.message);
+			dbus_error_free(&err);
+		} else
+			lua_pushliteral(L, "Couldn't create server");
 		return 2;
 	}
-	/* ..and save it */
-	lua_rawseti(L, 2, 1);
 
-	/* create signal table */
-	lua_newtable(L);
-	/* ..save it */
-	lua_pushvalue(L, 3);
-	lua_rawseti(L, 2, 2);
-	/* ..and move it to the thread */
-	lua_xmove(L, S, 1);
+	ls = lua_newuserdata(L, sizeof(LServer));
+	watchset_init(&ls->w, loop_get(L), server_ready);
+	ls->server = server;
+	/* servers are polled for as long as they listen */
+	ls->w.attached = 1;
 
-	/* set watch functions */
-	if (!dbus_connection_set_watch_functions(conn,
+	/* set the metatable */
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_setmetatable(L, 3);
+
+	/* keep the function wrapping new connections
+	 * in the environment of the server */
+	lua_createtable(L, 1, 0);
+	lua_pushvalue(L, lua_upvalueindex(2));
+	lua_pushvalue(L, lua_upvalueindex(3));
+	lua_pushcclosure(L, server_wrap, 2);
+	lua_rawseti(L, 4, 1);
+	lua_setfenv(L, 3);
+
+	if (!dbus_server_set_watch_functions(server,
 				(DBusAddWatchFunction)add_watch_cb,
 				(DBusRemoveWatchFunction)remove_watch_cb,
 				(DBusWatchToggledFunction)toggle_watch_cb,
-				c, NULL)) {
-		dbus_connection_unref(conn);
-		lua_pushnil(L);
-		lua_pushliteral(L, "Error setting watch functions");
-		return 2;
-	}
-
-	/* set the signal handler */
-	if (!dbus_connection_add_filter(conn,
-				(DBusHandleMessageFunction)signal_handler,
-				S, NULL)) {
-		dbus_connection_unref(conn);
+				&ls->w, NULL) ||
+			!dbus_server_set_timeout_functions(server,
+				(DBusAddTimeoutFunction)add_timeout_cb,
+				(DBusRemoveTimeoutFunction)remove_timeout_cb,
+				(DBusTimeoutToggledFunction)toggle_timeout_cb,
+				ls->w.loop, NULL)) {
 		lua_pushnil(L);
 		lua_pushliteral(L, "Out of memory");
 		return 2;
 	}
 
-	/* insert the connection in the connection table */
-	lua_pushlightuserdata(L, conn);
-	lua_pushvalue(L, 1);
-	lua_rawset(L, lua_upvalueindex(2));
+	dbus_server_set_new_connection_function(server,
+			(DBusNewConnectionFunction)server_new_connection,
+			ls, NULL);
 
-	/* return the connection */
-	lua_settop(L, 1);
+	/* get the callback table and anchor the server */
+	lua_pushlightuserdata(L, &callbacks_key);
+	lua_rawget(L, LUA_REGISTRYINDEX);
+	anchor(L, 4, 3, 2);
+	lua_settop(L, 3);
+
+	/* return the server */
 	return 1;
 }
 
 /*
- * SessionBus()
+ * Server:get_address()
+ *
+ * upvalue 1: Server
+ *
+ * argument 1: server
  */
-static int simpledbus_session_bus(lua_State *L)
+static int server_get_address(lua_State *L)
 {
-	return new_connection(L, dbus_bus_get(DBUS_BUS_SESSION, &err));
+	LServer *ls = server_check(L, 1);
+	char *address = dbus_server_get_address(ls->server);
+
+	if (address == NULL) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "Out of memory");
+		return 2;
+	}
+
+	lua_pushstring(L, address);
+	dbus_free(address);
+	return 1;
 }
 
 /*
- * SystemBus()
+ * Server:disconnect()
+ *
+ * upvalue 1: Server
+ *
+ * argument 1: server
  */
-static int simpledbus_system_bus(lua_State *L)
+static int server_disconnect(lua_State *L)
 {
-	return new_connection(L, dbus_bus_get(DBUS_BUS_SYSTEM, &err));
+	LServer *ls = server_check(L, 1);
+
+	lua_settop(L, 1);
+
+	if (ls->w.attached) {
+		/* stop accepting connections, this
+		 * also removes the listening watches */
+		dbus_server_disconnect(ls->server);
+		ls->w.attached = 0;
+		batch_forget(ls->w.loop, &ls->w.s);
+
+		lua_pushlightuserdata(L, &callbacks_key);
+		lua_rawget(L, LUA_REGISTRYINDEX);
+		unanchor(L, 2, 1);
+	}
+
+	/* return true */
+	lua_pushboolean(L, 1);
+	return 1;
 }
 
 /*
- * StarterBus()
+ * Server.__gc()
  */
-static int simpledbus_starter_bus(lua_State *L)
+static int server_gc(lua_State *L)
 {
-	return new_connection(L, dbus_bus_get(DBUS_BUS_STARTER, &err));
+	LServer *ls = lua_touserdata(L, 1);
+
+	if (dbus_server_get_is_connected(ls->server))
+		dbus_server_disconnect(ls->server);
+
+	(void)dbus_server_set_watch_functions(ls->server,
+			NULL, NULL, NULL, NULL, NULL);
+	(void)dbus_server_set_timeout_functions(ls->server,
+			NULL, NULL, NULL, NULL, NULL);
+	dbus_server_set_new_connection_function(ls->server,
+			NULL, NULL, NULL);
+	dbus_server_unref(ls->server);
+	watchset_free(&ls->w);
+
+	return 0;
 }
 
 /*
- * open()
+ * Loop.__gc()
  */
-static int simpledbus_open(lua_State *L)
+static int loop_gc(lua_State *L)
 {
-	return new_connection(L,
-			dbus_connection_open(luaL_checkstring(L, 1), &err));
+	simpledbus_loop *l = lua_touserdata(L, 1);
+
+	/* connections and servers collected after
+	 * the loop still remove their watches */
+	l->closed = 1;
+	if (l->users == 0)
+		loop_free(l);
+
+	return 0;
 }
 
 #define set_dbus_string_constant(L, i, name) \
@@ -1181,22 +4454,115 @@ LUALIB_API int luaopen_simpledbus_core(lua_State *L)
 {
 	luaL_Reg bus_funcs[] = {
 		{"get_signal_table", bus_get_signal_table},
+		{"set_owner_hook", bus_set_owner_hook},
 		{"call_method", bus_call_method},
+		{"call_lazy", bus_call_lazy},
 		{"send_signal", bus_send_signal},
 		{"register_object_path", bus_register_object_path},
 		{"unregister_object_path", bus_unregister_object_path},
+		{"get_fd", bus_get_fd},
+		{"set_budget", bus_set_budget},
+		{"set_priority", bus_set_priority},
+		{"attached", bus_attached},
+		{"is_peer", bus_is_peer},
+		{"dispatch_latency", bus_dispatch_latency},
+		{"latency", bus_latency},
+		{"stats", bus_stats},
+		{"set_reconnect", bus_set_reconnect},
 		{NULL, NULL}
 	};
 	luaL_Reg *p;
+	simpledbus_loop *l;
+
+	/* loops may run in several threads */
+	if (!dbus_threads_init_default())
+		return luaL_error(L, "Out of memory");
+
+	if (!dbus_connection_allocate_data_slot(&lcon_slot))
+		return luaL_error(L, "Out of memory");
+
+	/* create the main loop of this Lua state */
+	lua_pushlightuserdata(L, &loop_key);
+	l = lua_newuserdata(L, sizeof(simpledbus_loop));
+	l->mainThread = NULL;
+	l->stop = 0;
+	l->epfd = -1;
+	l->batch = NULL;
+	l->batch_n = 0;
+	l->conns = NULL;
+	l->nconns = 0;
+	l->conns_size = 0;
+	l->round = 0;
+	l->dispatching = 0;
+	l->resort = 0;
+	l->disconnects = 0;
+	l->iterations = 0;
+	l->wakeups = 0;
+	l->wake.ready = wake_ready;
+	l->wakefd = -1;
+	l->posts = NULL;
+	l->stop_requested = 0;
+	l->draining = 0;
+	l->deadline = 0;
+	l->sig.ready = sig_ready;
+	l->sigfd = -1;
+	sigemptyset(&l->sigmask);
+	sigemptyset(&l->sigblocked);
+	l->fdmux = NULL;
+	l->fdmux_size = 0;
+	l->users = 0;
+	l->closed = 0;
+	timer_wheel_init(&l->wheel);
+
+	/* close its file descriptors when the Lua state is closed */
+	lua_createtable(L, 0, 1);
+	lua_pushcclosure(L, loop_gc, 0);
+	lua_setfield(L, -2, "__gc");
+	lua_setmetatable(L, -2);
+	lua_rawset(L, LUA_REGISTRYINDEX);
+
+	/* create the epoll instance and the eventfd
+	 * used to wake up the loop from other threads */
+	l->epfd = epoll_create(16);
+	if (l->epfd < 0)
+		return luaL_error(L, "Error creating epoll instance: %s",
+				strerror(errno));
+
+	l->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (l->wakefd < 0)
+		return luaL_error(L, "Error creating eventfd: %s",
+				strerror(errno));
+	else {
+		struct epoll_event ev;
+
+		ev.events = EPOLLIN;
+		ev.data.ptr = &l->wake;
+		if (epoll_ctl(l->epfd, EPOLL_CTL_ADD, l->wakefd, &ev))
+			return luaL_error(L, "Error watching eventfd: %s",
+					strerror(errno));
+	}
 
-	/* initialise the errors */
-	dbus_error_init(&err);
-
-	/* initialise the vtable */
-	vtable.unregister_function = NULL;
-	vtable.message_function =
-		(DBusObjectPathMessageFunction)method_call_handler;
+	/* create the callback table and
+	 * a thread for running callbacks in */
+	lua_pushlightuserdata(L, &callbacks_key);
+	lua_newtable(L);
+	l->callbacks = lua_newthread(L);
+	lua_rawseti(L, -2, 1);
+	lua_pushvalue(L, -1);
+	lua_xmove(L, l->callbacks, 1);
+	lua_rawset(L, LUA_REGISTRYINDEX);
+
+	/* create the table of signal handlers */
+	lua_pushlightuserdata(L, &signals_key);
+	lua_newtable(L);
+	lua_rawset(L, LUA_REGISTRYINDEX);
 
+	/* create the metatable of method requests */
+	lua_pushlightuserdata(L, &request_key);
+	lua_createtable(L, 0, 1);
+	lua_pushcclosure(L, request_gc, 0);
+	lua_setfield(L, -2, "__gc");
+	lua_rawset(L, LUA_REGISTRYINDEX);
 
 	/* make a table for this module */
 	lua_newtable(L);
@@ -1205,9 +4571,222 @@ LUALIB_API int luaopen_simpledbus_core(lua_State *L)
 	lua_pushcclosure(L, simpledbus_stop, 0);
 	lua_setfield(L, 2, "stop");
 
+	/* insert the drain() function*/
+	lua_pushcclosure(L, simpledbus_drain, 0);
+	lua_setfield(L, 2, "drain");
+
+	/* insert the step() function*/
+	lua_pushcclosure(L, simpledbus_step, 0);
+	lua_setfield(L, 2, "step");
+
+	/* insert the get_fd() function*/
+	lua_pushcclosure(L, simpledbus_get_fd, 0);
+	lua_setfield(L, 2, "get_fd");
+
+	/* insert the timeout() function*/
+	lua_pushcclosure(L, simpledbus_timeout, 0);
+	lua_setfield(L, 2, "timeout");
+
+	/* insert the on_signal() function*/
+	lua_pushcclosure(L, simpledbus_on_signal, 0);
+	lua_setfield(L, 2, "on_signal");
+
+	/* insert the sleep() function*/
+	lua_pushcclosure(L, simpledbus_sleep, 0);
+	lua_setfield(L, 2, "sleep");
+
+	/* insert the now() function*/
+	lua_pushcclosure(L, simpledbus_now, 0);
+	lua_setfield(L, 2, "now");
+
+	/* make the Timer metatable */
+	lua_newtable(L);
+
+	/* Timer.__index = Timer */
+	lua_pushvalue(L, 3);
+	lua_setfield(L, 3, "__index");
+
+	/* insert Timer:cancel() */
+	lua_pushvalue(L, 3); /* upvalue 1: Timer */
+	lua_pushcclosure(L, timer_cancel, 1);
+	lua_setfield(L, 3, "cancel");
+
+	/* insert the after() function */
+	lua_pushvalue(L, 3); /* upvalue 1: Timer */
+	lua_pushcclosure(L, simpledbus_after, 1);
+	lua_setfield(L, 2, "after");
+
+	/* insert the every() function */
+	lua_pushvalue(L, 3); /* upvalue 1: Timer */
+	lua_pushcclosure(L, simpledbus_every, 1);
+	lua_setfield(L, 2, "every");
+
+	/* insert the Timer metatable */
+	lua_setfield(L, 2, "Timer");
+
+	/* insert the wait_readable() function*/
+	lua_pushcclosure(L, simpledbus_wait_readable, 0);
+	lua_setfield(L, 2, "wait_readable");
+
+	/* insert the wait_writable() function*/
+	lua_pushcclosure(L, simpledbus_wait_writable, 0);
+	lua_setfield(L, 2, "wait_writable");
+
+	/* make the Watch metatable */
+	lua_newtable(L);
+
+	/* Watch.__index = Watch */
+	lua_pushvalue(L, 3);
+	lua_setfield(L, 3, "__index");
+
+	/* insert Watch:set_mode() */
+	lua_pushvalue(L, 3); /* upvalue 1: Watch */
+	lua_pushcclosure(L, watch_set_mode, 1);
+	lua_setfield(L, 3, "set_mode");
+
+	/* insert Watch:cancel() */
+	lua_pushvalue(L, 3); /* upvalue 1: Watch */
+	lua_pushcclosure(L, watch_cancel, 1);
+	lua_setfield(L, 3, "cancel");
+
+	/* insert the watch_fd() function */
+	lua_pushvalue(L, 3); /* upvalue 1: Watch */
+	lua_pushcclosure(L, simpledbus_watch_fd, 1);
+	lua_setfield(L, 2, "watch_fd");
+
+	/* insert the Watch metatable */
+	lua_setfield(L, 2, "Watch");
+
+	/* insert the memfd() function */
+	lua_pushcclosure(L, memfd_new, 0);
+	lua_setfield(L, 2, "memfd");
+
+	/* insert the close_fd() function */
+	lua_pushcclosure(L, memfd_close, 0);
+	lua_setfield(L, 2, "close_fd");
+
+	/* make the Mapping metatable */
+	lua_newtable(L);
+
+	/* Mapping.__index = Mapping */
+	lua_pushvalue(L, 3);
+	lua_setfield(L, 3, "__index");
+
+	/* insert Mapping:sub() */
+	lua_pushvalue(L, 3); /* upvalue 1: Mapping */
+	lua_pushcclosure(L, mapping_sub, 1);
+	lua_setfield(L, 3, "sub");
+
+	/* insert Mapping:unmap() */
+	lua_pushvalue(L, 3); /* upvalue 1: Mapping */
+	lua_pushcclosure(L, mapping_unmap, 1);
+	lua_setfield(L, 3, "unmap");
+
+	/* insert the length metafunction */
+	lua_pushvalue(L, 3); /* upvalue 1: Mapping */
+	lua_pushcclosure(L, mapping_len, 1);
+	lua_setfield(L, 3, "__len");
+
+	/* insert the garbage collection metafunction */
+	lua_pushcclosure(L, mapping_gc, 0);
+	lua_setfield(L, 3, "__gc");
+
+	/* insert the map_fd() function */
+	lua_pushvalue(L, 3); /* upvalue 1: Mapping */
+	lua_pushcclosure(L, memfd_map, 1);
+	lua_setfield(L, 2, "map_fd");
+
+	/* insert the Mapping metatable */
+	lua_setfield(L, 2, "Mapping");
+
+	/* insert the encode() function */
+	lua_pushcclosure(L, codec_encode, 0);
+	lua_setfield(L, 2, "encode");
+
+	/* insert the decode() function */
+	lua_pushcclosure(L, codec_decode, 0);
+	lua_setfield(L, 2, "decode");
+
+	/* make the Message metatable */
+	lua_newtable(L);
+	message_init(L, 3);
+
+	/* insert the index metafunction */
+	lua_pushvalue(L, 3); /* upvalue 1: Message */
+	lua_pushcclosure(L, message_index, 1);
+	lua_setfield(L, 3, "__index");
+
+	/* insert the length metafunction */
+	lua_pushvalue(L, 3); /* upvalue 1: Message */
+	lua_pushcclosure(L, message_len, 1);
+	lua_setfield(L, 3, "__len");
+
+	/* insert the garbage collection metafunction */
+	lua_pushcclosure(L, message_gc, 0);
+	lua_setfield(L, 3, "__gc");
+
+	/* insert Message:unpack() */
+	lua_pushvalue(L, 3); /* upvalue 1: Message */
+	lua_pushcclosure(L, message_unpack, 1);
+	lua_setfield(L, 3, "unpack");
+
+	/* insert Message:into() */
+	lua_pushvalue(L, 3); /* upvalue 1: Message */
+	lua_pushcclosure(L, message_into, 1);
+	lua_setfield(L, 3, "into");
+
+	/* insert Message:signature() */
+	lua_pushvalue(L, 3); /* upvalue 1: Message */
+	lua_pushcclosure(L, message_signature, 1);
+	lua_setfield(L, 3, "signature");
+
+	/* insert Message:sender() */
+	lua_pushvalue(L, 3); /* upvalue 1: Message */
+	lua_pushcclosure(L, message_sender, 1);
+	lua_setfield(L, 3, "sender");
+
+	/* insert Message:path() */
+	lua_pushvalue(L, 3); /* upvalue 1: Message */
+	lua_pushcclosure(L, message_path, 1);
+	lua_setfield(L, 3, "path");
+
+	/* insert Message:interface() */
+	lua_pushvalue(L, 3); /* upvalue 1: Message */
+	lua_pushcclosure(L, message_interface, 1);
+	lua_setfield(L, 3, "interface");
+
+	/* insert Message:member() */
+	lua_pushvalue(L, 3); /* upvalue 1: Message */
+	lua_pushcclosure(L, message_member, 1);
+	lua_setfield(L, 3, "member");
+
+	/* make the Cursor metatable */
+	lua_createtable(L, 0, 1);
+
+	/* insert the garbage collection metafunction */
+	lua_pushcclosure(L, cursor_gc, 0);
+	lua_setfield(L, 4, "__gc");
+
+	/* insert Message:elements() */
+	lua_pushvalue(L, 3); /* upvalue 1: Message */
+	lua_pushvalue(L, 4); /* upvalue 2: Cursor */
+	lua_pushcclosure(L, message_elements, 2);
+	lua_setfield(L, 3, "elements");
+
+	/* pop the Cursor metatable */
+	lua_settop(L, 3);
+
+	/* insert the Message metatable */
+	lua_setfield(L, 2, "Message");
+
 	/* make the Bus metatable */
 	lua_newtable(L);
 
+	/* save it for C modules calling simpledbus_call() */
+	lua_pushlightuserdata(L, &bus_key);
+	lua_pushvalue(L, 3);
+	lua_rawset(L, LUA_REGISTRYINDEX);
+
 	/* DBus.__index = Bus */
 	lua_pushvalue(L, 3);
 	lua_setfield(L, 3, "__index");
@@ -1249,9 +4828,67 @@ LUALIB_API int luaopen_simpledbus_core(lua_State *L)
 	lua_pushcclosure(L, simpledbus_open, 2);
 	lua_setfield(L, 2, "open");
 
+	/* make the Server metatable */
+	lua_newtable(L);
+
+	/* Server.__index = Server */
+	lua_pushvalue(L, 5);
+	lua_setfield(L, 5, "__index");
+
+	/* insert Server:get_address() */
+	lua_pushvalue(L, 5); /* upvalue 1: Server */
+	lua_pushcclosure(L, server_get_address, 1);
+	lua_setfield(L, 5, "get_address");
+
+	/* insert Server:disconnect() */
+	lua_pushvalue(L, 5); /* upvalue 1: Server */
+	lua_pushcclosure(L, server_disconnect, 1);
+	lua_setfield(L, 5, "disconnect");
+
+	/* insert the garbage collection metafunction */
+	lua_pushcclosure(L, server_gc, 0);
+	lua_setfield(L, 5, "__gc");
+
+	/* insert the listen() function */
+	lua_pushvalue(L, 5); /* upvalue 1: Server */
+	lua_pushvalue(L, 3); /* upvalue 2: Bus */
+	lua_pushvalue(L, 4); /* upvalue 3: connection table */
+	lua_pushcclosure(L, simpledbus_listen, 3);
+	lua_setfield(L, 2, "listen");
+
+	/* insert the Server metatable */
+	lua_setfield(L, 2, "Server");
+
+	/* insert Bus:reconnect() */
+	lua_pushvalue(L, 3); /* upvalue 1: Bus */
+	lua_pushvalue(L, 4); /* upvalue 2: connection table */
+	lua_pushcclosure(L, bus_reconnect, 2);
+	lua_setfield(L, 3, "reconnect");
+
 	/* pop connection table */
 	lua_settop(L, 3);
 
+	/* make the Prepared metatable */
+	lua_newtable(L);
+
+	/* insert the garbage collection metafunction */
+	lua_pushcclosure(L, prepared_gc, 0);
+	lua_setfield(L, 4, "__gc");
+
+	/* insert the prepare_signal() function */
+	lua_pushvalue(L, 4); /* upvalue 1: Prepared */
+	lua_pushcclosure(L, simpledbus_prepare_signal, 1);
+	lua_setfield(L, 2, "prepare_signal");
+
+	/* insert Bus:emit() */
+	lua_pushvalue(L, 3); /* upvalue 1: Bus */
+	lua_pushvalue(L, 4); /* upvalue 2: Prepared */
+	lua_pushcclosure(L, bus_emit, 2);
+	lua_setfield(L, 3, "emit");
+
+	/* insert the Prepared metatable */
+	lua_setfield(L, 2, "Prepared");
+
 	/* insert Bus methods */
 	for (p = bus_funcs; p->name; p++) {
 		lua_pushvalue(L, 3); /* upvalue 1: Bus */
@@ -1308,6 +4945,9 @@ LUALIB_API int luaopen_simpledbus_core(lua_State *L)
 	set_dbus_string_constant(L, 2, INTERFACE_DBUS);
 	set_dbus_string_constant(L, 2, INTERFACE_INTROSPECTABLE);
 	set_dbus_string_constant(L, 2, INTERFACE_PROPERTIES);
+	lua_pushliteral(L, "INTERFACE_OBJECT_MANAGER");
+	lua_pushliteral(L, "org.freedesktop.DBus.ObjectManager");
+	lua_rawset(L, 2);
 	set_dbus_string_constant(L, 2, INTERFACE_PEER);
 	set_dbus_string_constant(L, 2, INTERFACE_LOCAL);
 
@@ -0,0 +1,91 @@
+/*
+ * SimpleDBus - Simple DBus bindings for Lua
+ * Copyright (C) 2008 Emil Renner Berthing <esmil@mailme.dk>
+ *
+ * SimpleDBus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * SimpleDBus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with SimpleDBus. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SIMPLEDBUS_H
+#define _SIMPLEDBUS_H
+
+#include <lua.h>
+#include <dbus/dbus.h>
+
+typedef struct simpledbus_loop simpledbus_loop;
+
+/*
+ * Returns the main loop of L, or NULL if simpledbus.core
+ * isn't loaded in it. This must be called from the thread
+ * owning L, but the loop may then be handed to other threads.
+ */
+LUALIB_API simpledbus_loop *simpledbus_get_loop(lua_State *L);
+
+/*
+ * The functions below are safe to call from any thread
+ * for as long as the Lua state of the loop is open.
+ *
+ * simpledbus_post() makes the loop call func in protected mode
+ * with data as a light userdata, like lua_cpcall() does. Errors
+ * stop the loop like errors in any other callback.
+ * Returns 0 on success or -1 if out of memory.
+ */
+LUALIB_API int simpledbus_post(simpledbus_loop *loop,
+		lua_CFunction func, void *data);
+
+/*
+ * simpledbus_request_stop() makes the running loop return true,
+ * like calling stop() from Lua. If the loop isn't running it
+ * stops as soon as it's started.
+ */
+LUALIB_API void simpledbus_request_stop(simpledbus_loop *loop);
+
+/*
+ * The functions below let C modules send messages they
+ * have built themselves over a bus, for example the bindings
+ * generated from introspection data by tools/bindgen.lua.
+ * They must be called from a Lua C function with its stack.
+ *
+ * simpledbus_call() sends the method call msg over the bus
+ * at index and returns what unmarshal pushes from the reply,
+ * or nil and an error message if the call fails. Like
+ * Bus:call_method() it yields while waiting for the reply if
+ * the main loop is running, so it must be called as
+ * return simpledbus_call(...). It takes over the reference
+ * to msg and may change the stack below index.
+ */
+typedef int (*simpledbus_unmarshal)(lua_State *L, DBusMessage *reply);
+
+LUALIB_API int simpledbus_call(lua_State *L, int index, DBusMessage *msg,
+		simpledbus_unmarshal unmarshal);
+
+/*
+ * simpledbus_send() sends msg over the bus at index without
+ * waiting for a reply and returns true, or nil and an error
+ * message. It takes over the reference to msg.
+ */
+LUALIB_API int simpledbus_send(lua_State *L, int index, DBusMessage *msg);
+
+/*
+ * simpledbus_add_value() adds the value at index to args as
+ * the single complete type in signature, the same way
+ * Bus:call_method() does. On error it pushes a message and
+ * returns non-zero.
+ *
+ * simpledbus_push_value() pushes the value args points to.
+ */
+LUALIB_API int simpledbus_add_value(lua_State *L, int index,
+		const char *signature, DBusMessageIter *args);
+LUALIB_API void simpledbus_push_value(lua_State *L, DBusMessageIter *args);
+
+#endif
@@ -46,38 +46,144 @@ do
    function M.Proxy:add_method(name, interface, signature, result)
       self[name] = new_method(name, interface, signature, result)
    end
+
+   -- use the methods of a module generated by tools/bindgen.lua
+   -- instead of calling them through Bus:call_method()
+   function M.Proxy:bind(binding)
+      for name, f in pairs(binding.methods) do
+         self[name] = f
+      end
+      return self
+   end
 end
 
 do
-   local call_method = M.Bus.call_method
+   local getmetatable, unpack = getmetatable, unpack
+   local Bus = M.Bus
+   local call_method = Bus.call_method
+   local call_lazy = Bus.call_lazy
+
+   -- like Bus:call_lazy(), but return the results decoded into the
+   -- list of tables t, so polling a method doesn't make new tables
+   local function call_into(bus, t, ...)
+      local reply, msg = call_lazy(bus, ...)
+      if not reply then return nil, msg end
+      return reply:into(unpack(t))
+   end
+   Bus.call_into = call_into
+
    function M.Method.__call(method, proxy, ...)
+      local bus = proxy.bus
+      if getmetatable(bus) ~= Bus then -- a pool
+         bus = bus:pick(proxy.target)
+      end
+      if method.into then -- decode into the tables given
+         return call_into(
+            bus, method.into, proxy.target, proxy.object,
+            method.interface, method.name, method.signature, ...)
+      end
+      if method.lazy then -- return the reply as a Message
+         return call_lazy(
+            bus, proxy.target, proxy.object,
+            method.interface, method.name, method.signature, ...)
+      end
       return call_method(
-         proxy.bus, proxy.target, proxy.object,
-         method.interface, method.name,
+         bus, proxy.target, proxy.object,
+         method.interface, method.name, method.noreply or false,
          method.signature, ...)
    end
 
    local target, object, interface =
       M.SERVICE_DBUS, M.PATH_DBUS, M.INTERFACE_DBUS
+   local EXISTS = M.REQUEST_NAME_REPLY_EXISTS
+
+   -- names requested on each connection, so
+   -- they can be requested again on reconnect
+   local names = setmetatable({}, { __mode = 'k' })
 
    function M.Bus:request_name(name, flags)
-      return call_method(self, target, object, interface,
-            'RequestName', 'su', name, flags or 0)
+      flags = flags or 0
+      local r, msg = call_method(self, target, object, interface,
+            'RequestName', false, 'su', name, flags)
+      if r and r ~= EXISTS then
+         local t = names[self]
+         if t == nil then
+            t = {}
+            names[self] = t
+         end
+         t[name] = flags
+      end
+      return r, msg
    end
 
    function M.Bus:release_name(name)
+      local t = names[self]
+      if t then t[name] = nil end
       return call_method(self, target, object, interface,
-            'ReleaseName', 's', name)
+            'ReleaseName', false, 's', name)
    end
 
    function M.Bus:add_match(rule)
       return call_method(self, target, object, interface,
-            'AddMatch', 's', rule)
+            'AddMatch', false, 's', rule)
    end
 
    function M.Bus:remove_match(rule)
       return call_method(self, target, object, interface,
-            'RemoveMatch', 's', rule)
+            'RemoveMatch', false, 's', rule)
+   end
+
+   local pairs, match, format = pairs, string.match, string.format
+   local min = math.min
+   local sleep = M.sleep
+   local request_name, add_match = M.Bus.request_name, M.Bus.add_match
+   local is_peer = M.Bus.is_peer
+   local INTERFACE_LOCAL = M.INTERFACE_LOCAL
+
+   -- Reconnect when the connection is lost, waiting min_ms
+   -- milliseconds before the first attempt and doubling the wait
+   -- up to max_ms between attempts. Once reconnected the match rules
+   -- of the signal table are added and the names requested again, and
+   -- f is called with the bus if given, though peers have no match
+   -- rules or names. Object paths are registered again by reconnect()
+   -- itself. Calls in flight when the connection
+   -- is lost fail with "Disconnected". The connection is only watched
+   -- while the main loop polls it.
+   function M.Bus:auto_reconnect(min_ms, max_ms, f)
+      min_ms = min_ms or 100
+      max_ms = max_ms or 10000
+
+      return self:set_reconnect(function(bus)
+         local wait = min_ms
+         while true do
+            sleep(wait)
+            if bus:reconnect() then break end
+            wait = min(2*wait, max_ms)
+         end
+
+         if is_peer(bus) then
+            if f then f(bus) end
+            return
+         end
+
+         for s in pairs(bus:get_signal_table()) do
+            local object, interface, name = match(s, '^(.-)\n(.-)\n(.*)$')
+            if interface and interface ~= INTERFACE_LOCAL then
+               add_match(bus,
+                  format("type='signal',path='%s',interface='%s',member='%s'",
+                        object, interface, name))
+            end
+         end
+
+         local t = names[bus]
+         if t then
+            for name, flags in pairs(t) do
+               request_name(bus, name, flags)
+            end
+         end
+
+         if f then f(bus) end
+      end)
    end
 end
 
@@ -111,15 +217,84 @@ do
 
       return proxy
    end
+
+   local pairs, getmetatable = pairs, getmetatable
+   local Method = M.Method
+   local GetManagedObjects = M.new_method('GetManagedObjects',
+      M.INTERFACE_OBJECT_MANAGER, '', 'a{oa{sa{sv}}}')
+   M.GetManagedObjects = GetManagedObjects
+
+   -- Build proxies for every object below the object manager at
+   -- root from a single GetManagedObjects() call. Each interface is
+   -- only introspected once, on the first object implementing it,
+   -- and the resulting methods are shared by all proxies.
+   -- Returns a table mapping object paths to proxies. Each proxy
+   -- has a properties field holding the interfaces and properties
+   -- from the reply.
+   function M.Bus:auto_proxies(target, root)
+      local objects, msg = GetManagedObjects(new_proxy(self, target, root))
+      if not objects then
+         return nil, msg
+      end
+
+      local methods, proxies = {}, {}
+
+      for path, interfaces in pairs(objects) do
+         local proxy = new_proxy(self, target, path)
+
+         for interface in pairs(interfaces) do
+            if methods[interface] == nil then
+               local p = new_proxy(self, target, path)
+
+               local r, msg = Introspect(p)
+               if not r then
+                  return nil, msg
+               end
+
+               r, msg = p:parse(r)
+               if not r then
+                  return nil, msg
+               end
+
+               for k, v in pairs(p) do
+                  if getmetatable(v) == Method then
+                     local t = methods[v.interface]
+                     if t == nil then
+                        t = {}
+                        methods[v.interface] = t
+                     end
+                     t[k] = v
+                  end
+               end
+
+               if methods[interface] == nil then
+                  methods[interface] = {}
+               end
+            end
+
+            for k, v in pairs(methods[interface]) do
+               proxy[k] = v
+            end
+         end
+
+         proxy.properties = interfaces
+         proxies[path] = proxy
+      end
+
+      return proxies
+   end
 end
 
 do
    local assert, getmetatable, type = assert, getmetatable, type
    local format = string.format
    local Bus = M.Bus
-   local add_match = M.Bus.add_match
+   local add_match, is_peer = M.Bus.add_match, M.Bus.is_peer
 
-   local function register_signal(bus, object, interface, name, f)
+   -- if lazy is true f is called with the signal as a Message
+   -- instead of its arguments. A peer sends us its signals
+   -- without match rules, so none are added for peers.
+   local function register_signal(bus, object, interface, name, f, lazy)
       assert(getmetatable(bus) == Bus,
          'bad argument #1 (expected a DBus connection)')
       assert(type(object) == 'string',
@@ -137,25 +312,30 @@ do
       -- signal must match the one in the C code
       local s = format('%s\n%s\n%s', object, interface, name)
 
-      if t[s] == nil then
+      if t[s] == nil and not is_peer(bus) then
          local r, msg = add_match(bus,
                format("type='signal',path='%s',interface='%s',member='%s'",
                      object, interface, name))
          if msg then return nil, msg end
       end
 
-      t[s] = f
+      -- the C code calls a handler in a table with the message
+      if lazy then
+         t[s] = { f }
+      else
+         t[s] = f
+      end
 
       return true
    end
    Bus.register_signal = register_signal
 
-   function Bus:register_auto_signal(signal, f)
+   function Bus:register_auto_signal(signal, f, lazy)
       return register_signal(self,
          signal.object,
          signal.interface,
          signal.name,
-         f)
+         f, lazy)
    end
 end
 
@@ -163,7 +343,7 @@ do
    local assert, getmetatable, type = assert, getmetatable, type
    local format = string.format
    local Bus = M.Bus
-   local remove_match = M.Bus.remove_match
+   local remove_match, is_peer = M.Bus.remove_match, M.Bus.is_peer
 
    local function unregister_signal(bus, object, interface, name)
       assert(getmetatable(bus) == Bus,
@@ -183,11 +363,13 @@ do
 
       assert(t[s] ~= nil, 'signal not set')
 
-      local r, msg = remove_match(bus,
-            format("type='signal',path='%s',interface='%s',member='%s'",
-                  object, interface, name))
+      if not is_peer(bus) then
+         local r, msg = remove_match(bus,
+               format("type='signal',path='%s',interface='%s',member='%s'",
+                     object, interface, name))
 
-      if msg then return nil, msg end
+         if msg then return nil, msg end
+      end
 
       t[s] = nil
 
@@ -203,20 +385,339 @@ do
    end
 end
 
+do
+   local pairs, next, getmetatable = pairs, next, getmetatable
+   local setmetatable, sub, format = setmetatable, string.sub, string.format
+   local Bus = M.Bus
+   local call_method = Bus.call_method
+   local add_match = Bus.add_match
+   local set_owner_hook = Bus.set_owner_hook
+   local attached = Bus.attached
+   local target, object, interface =
+      M.SERVICE_DBUS, M.PATH_DBUS, M.INTERFACE_DBUS
+
+   -- the owners of the names looked up or watched on each
+   -- connection, false for names without an owner, along with
+   -- the functions watching them and the proxies following them
+   local caches = setmetatable({}, { __mode = 'k' })
+
+   local function changed(cache, name, old, new)
+      local watchers, proxies = cache.watchers[name], cache.proxies[name]
+
+      if cache.owners[name] == nil and not cache.pending[name] and
+            watchers == nil and proxies == nil then
+         return
+      end
+
+      if new == '' then new = false end
+      cache.owners[name] = new
+
+      if proxies then
+         for proxy in pairs(proxies) do
+            proxy.target = new or name
+         end
+      end
+
+      if watchers then
+         if old == '' then old = nil end
+         for f in pairs(watchers) do
+            f(name, new or nil, old)
+         end
+      end
+   end
+
+   local NAME_OWNER_CHANGED = format(
+      "type='signal',sender='%s',path='%s',interface='%s',"
+      .. "member='NameOwnerChanged'", target, object, interface)
+
+   -- Subscribe to NameOwnerChanged from the bus itself,
+   -- once per connection. The owner hook only sees the signals
+   -- really sent by the bus and leaves the signal table alone.
+   local function get_cache(bus)
+      local cache = caches[bus]
+      if cache then return cache end
+
+      local r, msg = add_match(bus, NAME_OWNER_CHANGED)
+      if not r and msg then return nil, msg end
+
+      cache = { owners = {}, pending = {}, watchers = {}, proxies = {} }
+      caches[bus] = cache
+
+      set_owner_hook(bus, function(name, old, new)
+         changed(cache, name, old, new)
+      end)
+
+      return cache
+   end
+
+   -- Return the unique name owning name, or nil if it has no owner.
+   -- The first lookup of a name asks the bus, after that the owner
+   -- is kept up to date from NameOwnerChanged signals, so lookups
+   -- don't leave the process. The signals are only dispatched while
+   -- the bus is attached to the main loop, by mainloop() or get_fd(),
+   -- so otherwise every lookup asks the bus, and updates the proxies
+   -- and watchers of the name if the owner changed.
+   local function name_owner(bus, name)
+      if sub(name, 1, 1) == ':' or name == target then
+         return name
+      end
+
+      local cache, msg = get_cache(bus)
+      if not cache then return nil, msg end
+
+      if not attached(bus) then
+         local owner, msg = call_method(bus, target, object, interface,
+               'GetNameOwner', false, 's', name)
+         if not owner and msg and
+               not msg:match('^Could not get owner') then
+            return nil, msg
+         end
+
+         local old = cache.owners[name] or false
+         if old ~= (owner or false) then
+            changed(cache, name, old or '', owner or '')
+         end
+
+         return owner or nil
+      end
+
+      local owner = cache.owners[name]
+      if owner == nil then
+         cache.pending[name] = true
+         owner, msg = call_method(bus, target, object, interface,
+               'GetNameOwner', false, 's', name)
+         cache.pending[name] = nil
+         -- the owner may have changed while we waited
+         if cache.owners[name] ~= nil then
+            owner = cache.owners[name]
+         elseif not owner and msg and
+               not msg:match('^Could not get owner') then
+            return nil, msg
+         else
+            cache.owners[name] = owner or false
+         end
+      end
+
+      return owner or nil
+   end
+   Bus.name_owner = name_owner
+
+   -- Call f(name, new_owner, old_owner) whenever the owner of name
+   -- changes. The owners are nil when the name has no owner.
+   function Bus:watch_name(name, f)
+      local cache, msg = get_cache(self)
+      if not cache then return nil, msg end
+
+      local watchers = cache.watchers[name]
+      if watchers == nil then
+         watchers = {}
+         cache.watchers[name] = watchers
+      end
+      watchers[f] = true
+
+      return true
+   end
+
+   function Bus:unwatch_name(name, f)
+      local cache = caches[self]
+      local watchers = cache and cache.watchers[name]
+      if watchers then
+         watchers[f] = nil
+         if next(watchers) == nil then
+            cache.watchers[name] = nil
+         end
+      end
+
+      return true
+   end
+
+   -- owners may have changed while disconnected, so forget
+   -- them and let proxies use the well-known names again
+   local reconnect = Bus.reconnect
+   function Bus:reconnect()
+      local r, msg = reconnect(self)
+      local cache = caches[self]
+      if r and cache then
+         add_match(self, NAME_OWNER_CHANGED)
+         cache.owners = {}
+         for name, proxies in pairs(cache.proxies) do
+            for proxy in pairs(proxies) do
+               proxy.target = name
+            end
+         end
+      end
+      return r, msg
+   end
+
+   -- Send the calls of the proxy to the unique name owning its
+   -- target, so the bus doesn't have to resolve the name for every
+   -- call. The target is updated when the owner changes and goes
+   -- back to the well-known name when there is no owner.
+   function M.Proxy:follow_owner()
+      local bus = self.bus
+      if getmetatable(bus) ~= Bus then -- a pool
+         bus = bus[1]
+      end
+
+      local name = self.well_known or self.target
+      local owner, msg = name_owner(bus, name)
+      if msg then return nil, msg end
+
+      if owner ~= name then
+         local proxies = caches[bus].proxies
+         local t = proxies[name]
+         if t == nil then
+            t = setmetatable({}, { __mode = 'k' })
+            proxies[name] = t
+         end
+         t[self] = true
+         self.well_known = name
+      end
+      self.target = owner or name
+
+      return true
+   end
+end
+
 do
    local EObject = {}
    EObject.__index = EObject
 
    M.EObject = EObject
 
-   function M.Bus:register_object(o)
+   local pairs = pairs
+   local sub, concat = string.sub, table.concat
+   local Bus = M.Bus
+   local register_object_path = Bus.register_object_path
+   local unregister_object_path = Bus.unregister_object_path
+   local send_signal = Bus.send_signal
+   local OBJECT_MANAGER = M.INTERFACE_OBJECT_MANAGER
+
+   -- registry of exported EObjects and object manager
+   -- roots for each connection, indexed by object path
+   local objects = setmetatable({}, { __mode = 'k' })
+   local managers = setmetatable({}, { __mode = 'k' })
+
+   local function registry(t, bus)
+      local r = t[bus]
+      if r == nil then
+         r = {}
+         t[bus] = r
+      end
+      return r
+   end
+
+   local function is_child(root, path)
+      if root == '/' then
+         return path ~= '/'
+      end
+      return sub(path, 1, #root + 1) == root..'/'
+   end
+
+   local function interfaces_and_properties(o)
+      local t, properties = {}, o.properties
+      for interface in pairs(o.interfaces) do
+         t[interface] = properties[interface] or {}
+      end
+      return t
+   end
+
+   local function interface_names(o)
+      local t, n = {}, 0
+      for interface in pairs(o.interfaces) do
+         n = n+1
+         t[n] = interface
+      end
+      return t
+   end
+
+   -- emit signal from every object manager above path
+   local function managers_emit(bus, path, name, signature, arg)
+      local m = managers[bus]
+      if m == nil then return end
+
+      for root in pairs(m) do
+         if is_child(root, path) then
+            send_signal(bus, root, OBJECT_MANAGER, name,
+               signature, path, arg)
+         end
+      end
+   end
+
+   function Bus:register_object(o)
       assert(getmetatable(o) == EObject,
          'bad argument #2 (expected an EObject)')
 
-      return self:register_object_path(o.path, o.lookup)
+      local r, msg = register_object_path(self, o.path, o.lookup)
+      if not r then return nil, msg end
+
+      registry(objects, self)[o.path] = o
+
+      managers_emit(self, o.path, 'InterfacesAdded', 'oa{sa{sv}}',
+         interfaces_and_properties(o))
+
+      return r
    end
 
-   local sub, concat = string.sub, table.concat
+   function Bus:unregister_object_path(path)
+      local r, msg = unregister_object_path(self, path)
+      if not r then return nil, msg end
+
+      local t = objects[self]
+      local o = t and t[path]
+      if o then
+         t[path] = nil
+         managers_emit(self, path, 'InterfacesRemoved', 'oas',
+            interface_names(o))
+      end
+
+      local m = managers[self]
+      if m then m[path] = nil end
+
+      return r
+   end
+
+   function Bus:unregister_object(o)
+      assert(getmetatable(o) == EObject,
+         'bad argument #2 (expected an EObject)')
+
+      return self:unregister_object_path(o.path)
+   end
+
+   -- Register o (or a new EObject at the path o) as an
+   -- org.freedesktop.DBus.ObjectManager for all objects below it.
+   -- GetManagedObjects() is answered directly from the registry of
+   -- objects exported with register_object(), and InterfacesAdded/
+   -- InterfacesRemoved are emitted as objects come and go.
+   function Bus:register_object_manager(o)
+      if type(o) == 'string' then
+         o = EObject(o)
+      end
+      assert(getmetatable(o) == EObject,
+         'bad argument #2 (expected an EObject or object path)')
+
+      local bus, root = self, o.path
+
+      o:add_method(OBJECT_MANAGER, 'GetManagedObjects',
+         '', 'a{oa{sa{sv}}}', function()
+            local r, t = {}, objects[bus]
+            if t then
+               for path, o in pairs(t) do
+                  if is_child(root, path) then
+                     r[path] = interfaces_and_properties(o)
+                  end
+               end
+            end
+            return r
+         end)
+
+      local r, msg = self:register_object(o)
+      if not r then return nil, msg end
+
+      registry(managers, self)[root] = o
+
+      return o
+   end
 
    local function value_end(i, sig)
       local char = sub(sig, i, i)
@@ -328,12 +829,148 @@ do
                ['Introspect'] = [[
 <method name="Introspect"><arg name="data" direction="out" type="s" /></method>]]
             }
-         }
+         },
+         -- property tables by interface name, reported
+         -- by GetManagedObjects() and InterfacesAdded
+         properties = {}
       }
       return setmetatable(t, EObject)
    end})
 end
 
+do
+   local Pool = {}
+   Pool.__index = Pool
+
+   local setmetatable, getmetatable = setmetatable, getmetatable
+   local type, unpack, select = type, unpack, select
+   local Bus = M.Bus
+   local call_method = Bus.call_method
+
+   -- A pool of private connections to the same bus used like a
+   -- single connection. Method calls are spread over the connections,
+   -- so a large reply on one of them doesn't hold up the others.
+   -- With the default mode, 'destination', each destination sticks
+   -- to one connection, which keeps calls to it in order. With
+   -- 'round-robin' every call goes to the next connection.
+   -- Everything else, like owning names, exporting objects and
+   -- receiving signals, is done by the first connection.
+   function M.Pool(connections, mode)
+      assert(#connections > 0, 'bad argument #1 (no connections)')
+      assert(mode == nil or mode == 'destination' or mode == 'round-robin',
+         "bad argument #2 (mode must be 'destination' or 'round-robin')")
+
+      local pool = { n = #connections, next = 0, shards = {},
+         round_robin = mode == 'round-robin' }
+      for i, bus in ipairs(connections) do
+         assert(getmetatable(bus) == Bus,
+            'bad argument #1 (expected DBus connections)')
+         pool[i] = bus
+      end
+
+      return setmetatable(pool, Pool)
+   end
+
+   local function new_pool(open, n, mode)
+      local connections = {}
+      for i = 1, n do
+         local bus, msg = open(true)
+         if not bus then return nil, msg end
+         connections[i] = bus
+      end
+      return M.Pool(connections, mode)
+   end
+
+   function M.SessionPool(n, mode)
+      return new_pool(M.SessionBus, n, mode)
+   end
+
+   function M.SystemPool(n, mode)
+      return new_pool(M.SystemBus, n, mode)
+   end
+
+   function Pool:pick(target)
+      local i
+      if self.round_robin then
+         i = self.next % self.n + 1
+         self.next = i
+      else
+         -- hand out connections to new destinations in turn
+         i = self.shards[target]
+         if i == nil then
+            i = self.next % self.n + 1
+            self.next = i
+            self.shards[target] = i
+         end
+      end
+      return self[i]
+   end
+
+   function Pool:call_method(target, ...)
+      return call_method(self:pick(target), target, ...)
+   end
+
+   function Pool:call_lazy(target, ...)
+      return Bus.call_lazy(self:pick(target), target, ...)
+   end
+
+   function Pool:call_into(t, target, ...)
+      return Bus.call_into(self:pick(target), t, target, ...)
+   end
+
+   function Pool:connections()
+      return unpack(self, 1, self.n)
+   end
+
+   function Pool:get_fd()
+      local fd, msg
+      for i = 1, self.n do
+         fd, msg = self[i]:get_fd()
+         if not fd then return nil, msg end
+      end
+      return fd
+   end
+
+   -- proxies made from a pool call through the pool
+   Pool.new_proxy = Bus.new_proxy
+   Pool.auto_proxy = Bus.auto_proxy
+   Pool.auto_proxies = Bus.auto_proxies
+
+   -- the rest of the Bus methods work on the first connection
+   setmetatable(Pool, { __index = function(_, k)
+      local f = Bus[k]
+      if type(f) ~= 'function' then return nil end
+      local function method(self, ...)
+         return f(self[1], ...)
+      end
+      Pool[k] = method
+      return method
+   end })
+
+   -- let the main loop run all connections of a pool
+   local mainloop = M.mainloop
+   local function expand(...)
+      local t, n = {}, 0
+      for i = 1, select('#', ...) do
+         local v = select(i, ...)
+         if getmetatable(v) == Pool then
+            for j = 1, v.n do
+               n = n+1
+               t[n] = v[j]
+            end
+         else
+            n = n+1
+            t[n] = v
+         end
+      end
+      return unpack(t, 1, n)
+   end
+
+   function M.mainloop(...)
+      return mainloop(expand(...))
+   end
+end
+
 return M
 
 -- vi: syntax=lua ts=3 sw=3 et:
@@ -0,0 +1,229 @@
+/*
+ * SimpleDBus - Simple DBus bindings for Lua
+ * Copyright (C) 2008 Emil Renner Berthing <esmil@mailme.dk>
+ *
+ * SimpleDBus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * SimpleDBus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with SimpleDBus. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ALLINONE
+#include <time.h>
+
+#define EXPORT
+#endif
+
+#include "timer.h"
+
+/*
+ * Milliseconds on the monotonic clock
+ */
+EXPORT uint64_t timer_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+EXPORT void timer_wheel_init(struct timer_wheel *w)
+{
+	unsigned int i, j;
+
+	w->base = timer_now();
+	w->count = 0;
+	w->expired = NULL;
+
+	for (i = 0; i < TIMER_LEVELS; i++)
+		for (j = 0; j < TIMER_SLOTS; j++)
+			w->slots[i][j] = NULL;
+}
+
+EXPORT void timer_init(struct timer *t, timer_callback callback)
+{
+	t->next = NULL;
+	t->pprev = NULL;
+	t->expires = 0;
+	t->callback = callback;
+}
+
+static void timer_link(struct timer **head, struct timer *t)
+{
+	t->next = *head;
+	if (t->next)
+		t->next->pprev = &t->next;
+	t->pprev = head;
+	*head = t;
+}
+
+static void timer_unlink(struct timer *t)
+{
+	if (t->next)
+		t->next->pprev = t->pprev;
+	*t->pprev = t->next;
+	t->next = NULL;
+	t->pprev = NULL;
+}
+
+/*
+ * Put t in the slot it belongs to relative to the current base.
+ * The expiry must not be before the base.
+ */
+static void timer_place(struct timer_wheel *w, struct timer *t)
+{
+	uint64_t expires = t->expires;
+	uint64_t delta;
+	unsigned int level;
+
+	delta = expires - w->base;
+
+	for (level = 0; level < TIMER_LEVELS - 1; level++) {
+		if (delta < (uint64_t)1 << (TIMER_BITS * (level + 1)))
+			break;
+	}
+
+	/* timers too far into the future are put in the last slot
+	 * of the top level and placed again when cascaded */
+	if (delta >= (uint64_t)1 << (TIMER_BITS * TIMER_LEVELS))
+		expires = w->base +
+			((uint64_t)1 << (TIMER_BITS * TIMER_LEVELS)) - 1;
+
+	timer_link(&w->slots[level]
+			[(expires >> (TIMER_BITS * level)) & TIMER_MASK], t);
+}
+
+EXPORT void timer_del(struct timer_wheel *w, struct timer *t)
+{
+	if (!timer_pending(t))
+		return;
+
+	timer_unlink(t);
+	w->count--;
+}
+
+EXPORT void timer_add(struct timer_wheel *w, struct timer *t,
+		uint64_t expires)
+{
+	if (timer_pending(t))
+		timer_del(w, t);
+
+	/* the slot of the current tick has already
+	 * been processed, so expire on the next */
+	if (expires <= w->base)
+		expires = w->base + 1;
+
+	t->expires = expires;
+	timer_place(w, t);
+	w->count++;
+}
+
+/*
+ * Milliseconds until something needs to happen in the wheel or
+ * -1 if there are no timers. For level 0 this is exact, for
+ * higher levels it is the time of the next cascade of a non-empty
+ * slot, so we'll never sleep past an expiry.
+ */
+EXPORT int timer_next(struct timer_wheel *w)
+{
+	uint64_t now = timer_now();
+	uint64_t next = (uint64_t)-1;
+	unsigned int level;
+
+	if (w->expired)
+		return 0;
+
+	if (w->count == 0)
+		return -1;
+
+	for (level = 0; level < TIMER_LEVELS; level++) {
+		unsigned int shift = TIMER_BITS * level;
+		uint64_t block = w->base >> shift;
+		unsigned int j;
+
+		for (j = 1; j <= TIMER_SLOTS; j++) {
+			if (w->slots[level][(block + j) & TIMER_MASK]) {
+				uint64_t t = (block + j) << shift;
+
+				if (t < next)
+					next = t;
+				break;
+			}
+		}
+	}
+
+	if (next <= now)
+		return 0;
+
+	if (next - now > 0x7fffffff)
+		return 0x7fffffff;
+
+	return (int)(next - now);
+}
+
+static void timer_cascade(struct timer_wheel *w, unsigned int level)
+{
+	struct timer **head = &w->slots[level]
+		[(w->base >> (TIMER_BITS * level)) & TIMER_MASK];
+
+	while (*head) {
+		struct timer *t = *head;
+
+		timer_unlink(t);
+		timer_place(w, t);
+	}
+}
+
+/*
+ * Advance the wheel to the current time and call the
+ * callbacks of all expired timers. Callbacks may add
+ * and delete timers, including the ones about to expire.
+ */
+EXPORT void timer_run(struct timer_wheel *w)
+{
+	uint64_t now = timer_now();
+
+	while (w->base < now) {
+		struct timer **head;
+		unsigned int level;
+
+		w->base++;
+
+		for (level = 1; level < TIMER_LEVELS; level++) {
+			if (w->base & (((uint64_t)1 << (TIMER_BITS * level)) - 1))
+				break;
+			timer_cascade(w, level);
+		}
+
+		head = &w->slots[0][w->base & TIMER_MASK];
+		while (*head) {
+			struct timer *t = *head;
+
+			timer_unlink(t);
+			timer_link(&w->expired, t);
+		}
+
+		/* skip ahead if the wheel is empty */
+		if (w->count == 0) {
+			w->base = now;
+			break;
+		}
+	}
+
+	while (w->expired) {
+		struct timer *t = w->expired;
+
+		timer_unlink(t);
+		w->count--;
+		t->callback(t);
+	}
+}
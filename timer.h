@@ -0,0 +1,66 @@
+/*
+ * SimpleDBus - Simple DBus bindings for Lua
+ * Copyright (C) 2008 Emil Renner Berthing <esmil@mailme.dk>
+ *
+ * SimpleDBus is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * SimpleDBus is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with SimpleDBus. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TIMER_H
+#define _TIMER_H
+
+#include <stdint.h>
+
+/*
+ * Timers are kept in a hierarchical timing wheel with millisecond
+ * ticks. Level 0 has a slot for each of the next 64 milliseconds,
+ * level 1 a slot for each of the next 64 blocks of 64 milliseconds
+ * and so on. Timers in a higher level are cascaded down when the
+ * lower level wraps around, so adding and removing a timer is O(1).
+ */
+#define TIMER_BITS   6
+#define TIMER_SLOTS  (1 << TIMER_BITS)
+#define TIMER_MASK   (TIMER_SLOTS - 1)
+#define TIMER_LEVELS 5
+
+struct timer;
+
+typedef void (*timer_callback)(struct timer *t);
+
+struct timer {
+	struct timer *next;
+	struct timer **pprev;
+	uint64_t expires;
+	timer_callback callback;
+};
+
+struct timer_wheel {
+	uint64_t base;          /* last tick processed */
+	unsigned int count;     /* number of timers in the wheel */
+	struct timer *expired;  /* timers waiting for their callback */
+	struct timer *slots[TIMER_LEVELS][TIMER_SLOTS];
+};
+
+#define timer_pending(t) ((t)->pprev != NULL)
+
+#ifndef ALLINONE
+uint64_t timer_now(void);
+void timer_wheel_init(struct timer_wheel *w);
+void timer_init(struct timer *t, timer_callback callback);
+void timer_add(struct timer_wheel *w, struct timer *t, uint64_t expires);
+void timer_del(struct timer_wheel *w, struct timer *t);
+int timer_next(struct timer_wheel *w);
+void timer_run(struct timer_wheel *w);
+#endif
+
+#endif
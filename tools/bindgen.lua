@@ -0,0 +1,704 @@
+-- Generate a C module with bindings for the interfaces
+-- described by introspection data
+--
+-- usage: lua bindgen.lua <module name> <introspection xml> [output.c]
+--
+-- The XML is read by Proxy:parse(), so the methods and signals
+-- are the same as the ones an auto_proxy() would have. For each
+-- signature the module gets functions marshalling and
+-- unmarshalling exactly that type, so nothing is interpreted at
+-- runtime. Replies are checked against the expected signature
+-- before they are read. Variants are still handled like
+-- Bus:call_method() does, since their type is only known then.
+--
+-- The module returns a table like
+--
+--   {
+--      methods = { Name = function(proxy, ...), ... },
+--      signals = { Name = function(bus, path, ...), ... },
+--   }
+--
+-- Use proxy:bind(module) to call the methods through it, or call
+-- the functions directly. Signals are sent like Bus:send_signal()
+-- would send them.
+--
+-- Build the output like any other C module using libdbus, but link
+-- it against simpledbus/core.so too for the functions in simpledbus.h:
+--
+--   cc -shared -fpic $(pkg-config --cflags dbus-1 lua5.1) bluez.c \
+--      -o bluez.so $(pkg-config --libs dbus-1) \
+--      /usr/lib/lua/5.1/simpledbus/core.so
+
+local DBus = require 'simpledbus'
+
+local format, concat = string.format, table.concat
+
+local usage = 'usage: bindgen.lua <module name> <introspection xml> [output.c]\n'
+
+-- C types and type codes of the basic D-Bus types
+local basic = {
+   y = { 'unsigned char', 'DBUS_TYPE_BYTE',        'number'  },
+   b = { 'dbus_bool_t',   'DBUS_TYPE_BOOLEAN',     'boolean' },
+   n = { 'dbus_int16_t',  'DBUS_TYPE_INT16',       'number'  },
+   q = { 'dbus_uint16_t', 'DBUS_TYPE_UINT16',      'number'  },
+   i = { 'dbus_int32_t',  'DBUS_TYPE_INT32',       'number'  },
+   u = { 'dbus_uint32_t', 'DBUS_TYPE_UINT32',      'number'  },
+   x = { 'dbus_int64_t',  'DBUS_TYPE_INT64',       'number'  },
+   t = { 'dbus_uint64_t', 'DBUS_TYPE_UINT64',      'number'  },
+   d = { 'double',        'DBUS_TYPE_DOUBLE',      'number'  },
+   h = { 'int',           'DBUS_TYPE_UNIX_FD',     'number'  },
+   s = { 'const char *',  'DBUS_TYPE_STRING',      'string'  },
+   o = { 'const char *',  'DBUS_TYPE_OBJECT_PATH', 'string'  },
+   g = { 'const char *',  'DBUS_TYPE_SIGNATURE',   'string'  },
+}
+
+-- arrays of these are read and written in one go
+local fixed = {
+   y = true, n = true, q = true, i = true,
+   u = true, x = true, t = true, d = true,
+}
+
+-- parse the complete type starting at position i of sig,
+-- returns the type and the position after it
+local function parse_type(sig, i)
+   local c = sig:sub(i, i)
+   local t
+
+   if c == 'a' then
+      if sig:sub(i + 1, i + 1) == '{' then
+         local key, value, j
+         key, j = parse_type(sig, i + 2)
+         value, j = parse_type(sig, j)
+         if sig:sub(j, j) ~= '}' then
+            error(format("invalid signature '%s'", sig), 0)
+         end
+         t = { kind = 'dict', key = key, value = value }
+         i = j + 1
+      else
+         local elem
+         elem, i = parse_type(sig, i + 1)
+         t = { kind = 'array', elem = elem }
+      end
+   elseif c == '(' then
+      local fields, j = {}, i + 1
+      while sig:sub(j, j) ~= ')' do
+         if j > #sig then
+            error(format("invalid signature '%s'", sig), 0)
+         end
+         fields[#fields + 1], j = parse_type(sig, j)
+      end
+      t = { kind = 'struct', fields = fields }
+      i = j + 1
+   elseif basic[c] or c == 'v' then
+      t = { kind = c }
+      i = i + 1
+   else
+      error(format("invalid signature '%s'", sig), 0)
+   end
+
+   return t, i
+end
+
+-- split a signature into a list of complete types
+local function parse_signature(sig)
+   local types, i = {}, 1
+   while i <= #sig do
+      types[#types + 1], i = parse_type(sig, i)
+   end
+   return types
+end
+
+local function type_signature(t)
+   if t.kind == 'dict' then
+      return 'a{' .. type_signature(t.key) .. type_signature(t.value) .. '}'
+   elseif t.kind == 'array' then
+      return 'a' .. type_signature(t.elem)
+   elseif t.kind == 'struct' then
+      local s = {}
+      for i, f in ipairs(t.fields) do
+         s[i] = type_signature(f)
+      end
+      return '(' .. concat(s) .. ')'
+   end
+   return t.kind
+end
+
+-- declare a variable of a C type
+local function decl(ctype, name)
+   if ctype:sub(-1) == '*' then
+      return ctype .. name
+   end
+   return ctype .. ' ' .. name
+end
+
+local out = {}
+local function emit(...)
+   out[#out + 1] = format(...)
+end
+
+-- the functions adding and pushing each type, by signature
+local adders, pushers, nfuncs = {}, {}, 0
+
+local function adder(t)
+   local sig = type_signature(t)
+   local name = adders[sig]
+   if name then return name end
+
+   -- make sure the functions for the contained types come first
+   local elem, key, value, fields
+   if t.kind == 'array' and not fixed[t.elem.kind] then
+      elem = adder(t.elem)
+   elseif t.kind == 'dict' then
+      key, value = adder(t.key), adder(t.value)
+   elseif t.kind == 'struct' then
+      fields = {}
+      for i, f in ipairs(t.fields) do
+         fields[i] = adder(f)
+      end
+   end
+
+   nfuncs = nfuncs + 1
+   name = format('add_%d', nfuncs)
+   adders[sig] = name
+
+   emit('/* %s */\n', sig)
+   emit('static int %s(lua_State *L, int index, DBusMessageIter *args)\n{\n', name)
+
+   local b = basic[t.kind]
+   if b and t.kind ~= 'h' and t.kind ~= 'g' then
+      local ctype, code, ltype = b[1], b[2], b[3]
+      emit('\t%s;\n\n', decl(ctype, 'v'))
+      if ltype == 'number' then
+         emit('\tif (!lua_isnumber(L, index))\n'
+            .. '\t\treturn add_error(L, index, LUA_TNUMBER);\n'
+            .. '\tv = (%s)lua_tonumber(L, index);\n', ctype)
+      elseif ltype == 'boolean' then
+         emit('\tif (!lua_isboolean(L, index))\n'
+            .. '\t\treturn add_error(L, index, LUA_TBOOLEAN);\n'
+            .. '\tv = lua_toboolean(L, index);\n')
+      else
+         emit('\tif (!lua_isstring(L, index))\n'
+            .. '\t\treturn add_error(L, index, LUA_TSTRING);\n'
+            .. '\tv = lua_tostring(L, index);\n')
+      end
+      emit('\tdbus_message_iter_append_basic(args, %s, &v);\n'
+         .. '\treturn 0;\n}\n\n', code)
+   elseif t.kind == 'array' and fixed[t.elem.kind] then
+      local ctype, code = basic[t.elem.kind][1], basic[t.elem.kind][2]
+      emit([[
+	DBusMessageIter array;
+	%s *v;
+	int n, i;
+
+	if (!lua_istable(L, index))
+		return add_error(L, index, LUA_TTABLE);
+
+	n = lua_objlen(L, index);
+	v = lua_newuserdata(L, n * sizeof(%s));
+	for (i = 0; i < n; i++) {
+		lua_rawgeti(L, index, i + 1);
+		if (!lua_isnumber(L, -1)) {
+			add_error(L, -1, LUA_TNUMBER);
+			/* leave only the error message */
+			lua_replace(L, -3);
+			lua_pop(L, 1);
+			return 1;
+		}
+		v[i] = (%s)lua_tonumber(L, -1);
+		lua_pop(L, 1);
+	}
+
+	dbus_message_iter_open_container(args, DBUS_TYPE_ARRAY,
+			"%s", &array);
+	dbus_message_iter_append_fixed_array(&array, %s, &v, n);
+	dbus_message_iter_close_container(args, &array);
+	lua_pop(L, 1);
+	return 0;
+}
+
+]], ctype, ctype, ctype, t.elem.kind, code)
+   elseif t.kind == 'array' then
+      emit([[
+	DBusMessageIter array;
+	int i;
+
+	if (!lua_istable(L, index))
+		return add_error(L, index, LUA_TTABLE);
+
+	dbus_message_iter_open_container(args, DBUS_TYPE_ARRAY,
+			"%s", &array);
+	for (i = 1; ; i++) {
+		lua_rawgeti(L, index, i);
+		if (lua_isnil(L, -1))
+			break;
+		if (%s(L, lua_gettop(L), &array)) {
+			lua_remove(L, -2);
+			dbus_message_iter_abandon_container(args, &array);
+			return 1;
+		}
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+	dbus_message_iter_close_container(args, &array);
+	return 0;
+}
+
+]], type_signature(t.elem), elem)
+   elseif t.kind == 'dict' then
+      emit([[
+	DBusMessageIter array;
+	DBusMessageIter entry;
+	int r;
+
+	if (!lua_istable(L, index))
+		return add_error(L, index, LUA_TTABLE);
+
+	dbus_message_iter_open_container(args, DBUS_TYPE_ARRAY,
+			"%s", &array);
+	lua_pushnil(L);
+	while (lua_next(L, index)) {
+		dbus_message_iter_open_container(&array,
+				DBUS_TYPE_DICT_ENTRY, NULL, &entry);
+		/* add a copy of the key, since converting the key
+		 * lua_next() is using to a string would confuse it */
+		lua_pushvalue(L, -2);
+		r = %s(L, lua_gettop(L), &entry);
+		lua_remove(L, r ? -2 : -1);
+		if (r || %s(L, lua_gettop(L), &entry)) {
+			/* leave only the error message */
+			lua_replace(L, -3);
+			lua_pop(L, 1);
+			dbus_message_iter_abandon_container(&array, &entry);
+			dbus_message_iter_abandon_container(args, &array);
+			return 1;
+		}
+		dbus_message_iter_close_container(&array, &entry);
+		lua_pop(L, 1);
+	}
+	dbus_message_iter_close_container(args, &array);
+	return 0;
+}
+
+]], sig:sub(2), key, value)
+   elseif t.kind == 'struct' then
+      emit([[
+	DBusMessageIter fields;
+
+	if (!lua_istable(L, index))
+		return add_error(L, index, LUA_TTABLE);
+
+	dbus_message_iter_open_container(args, DBUS_TYPE_STRUCT,
+			NULL, &fields);
+]])
+      for i, f in ipairs(fields) do
+         emit([[
+	lua_rawgeti(L, index, %d);
+	if (%s(L, lua_gettop(L), &fields)) {
+		lua_remove(L, -2);
+		dbus_message_iter_abandon_container(args, &fields);
+		return 1;
+	}
+	lua_pop(L, 1);
+]], i, f)
+      end
+      emit('\tdbus_message_iter_close_container(args, &fields);\n'
+         .. '\treturn 0;\n}\n\n')
+   else
+      -- variants, unix fds and signatures
+      emit('\treturn simpledbus_add_value(L, index, "%s", args);\n}\n\n', sig)
+   end
+
+   return name
+end
+
+local function pusher(t)
+   local sig = type_signature(t)
+   local name = pushers[sig]
+   if name then return name end
+
+   local elem, key, value, fields
+   if t.kind == 'array' and not fixed[t.elem.kind] then
+      elem = pusher(t.elem)
+   elseif t.kind == 'dict' then
+      key, value = pusher(t.key), pusher(t.value)
+   elseif t.kind == 'struct' then
+      fields = {}
+      for i, f in ipairs(t.fields) do
+         fields[i] = pusher(f)
+      end
+   end
+
+   nfuncs = nfuncs + 1
+   name = format('push_%d', nfuncs)
+   pushers[sig] = name
+
+   emit('/* %s */\n', sig)
+   emit('static void %s(lua_State *L, DBusMessageIter *args)\n{\n', name)
+
+   local b = basic[t.kind]
+   if b then
+      local ctype, ltype = b[1], b[3]
+      emit('\t%s;\n\n\tdbus_message_iter_get_basic(args, &v);\n',
+         decl(ctype, 'v'))
+      if ltype == 'number' then
+         emit('\tlua_pushnumber(L, (lua_Number)v);\n}\n\n')
+      elseif ltype == 'boolean' then
+         emit('\tlua_pushboolean(L, v);\n}\n\n')
+      else
+         emit('\tlua_pushstring(L, v);\n}\n\n')
+      end
+   elseif t.kind == 'array' and fixed[t.elem.kind] then
+      local ctype = basic[t.elem.kind][1]
+      emit([[
+	DBusMessageIter array;
+	const %s *v;
+	int n, i;
+
+	dbus_message_iter_recurse(args, &array);
+	dbus_message_iter_get_fixed_array(&array, &v, &n);
+	lua_createtable(L, n, 0);
+	for (i = 0; i < n; i++) {
+		lua_pushnumber(L, (lua_Number)v[i]);
+		lua_rawseti(L, -2, i + 1);
+	}
+}
+
+]], ctype)
+   elseif t.kind == 'array' then
+      emit([[
+	DBusMessageIter array;
+	int i = 0;
+
+	lua_newtable(L);
+	dbus_message_iter_recurse(args, &array);
+	while (dbus_message_iter_get_arg_type(&array) != DBUS_TYPE_INVALID) {
+		%s(L, &array);
+		lua_rawseti(L, -2, ++i);
+		dbus_message_iter_next(&array);
+	}
+}
+
+]], elem)
+   elseif t.kind == 'dict' then
+      emit([[
+	DBusMessageIter array;
+	DBusMessageIter entry;
+
+	lua_newtable(L);
+	dbus_message_iter_recurse(args, &array);
+	while (dbus_message_iter_get_arg_type(&array) == DBUS_TYPE_DICT_ENTRY) {
+		dbus_message_iter_recurse(&array, &entry);
+		%s(L, &entry);
+		dbus_message_iter_next(&entry);
+		%s(L, &entry);
+		lua_rawset(L, -3);
+		dbus_message_iter_next(&array);
+	}
+}
+
+]], key, value)
+   elseif t.kind == 'struct' then
+      emit([[
+	DBusMessageIter fields;
+
+	lua_createtable(L, %d, 0);
+	dbus_message_iter_recurse(args, &fields);
+]], #fields)
+      for i, f in ipairs(fields) do
+         if i > 1 then
+            emit('\tdbus_message_iter_next(&fields);\n')
+         end
+         emit('\t%s(L, &fields);\n\tlua_rawseti(L, -2, %d);\n', f, i)
+      end
+      emit('}\n\n')
+   else
+      emit('\tsimpledbus_push_value(L, args);\n}\n\n')
+   end
+
+   return name
+end
+
+-- the arguments are added starting at index first
+local function add_arguments(types, first, sig)
+   local adds = {}
+   for i, t in ipairs(types) do
+      adds[i] = adder(t)
+   end
+   return function()
+      for i, add in ipairs(adds) do
+         emit('\tif (%s(L, %d, &args))\n'
+            .. '\t\treturn marshal_error(L, msg, %d, "%s");\n',
+            add, first + i - 1, i, sig)
+      end
+   end
+end
+
+local function method(m, n)
+   local args = parse_signature(m.signature or '')
+   local results = parse_signature(m.result or '')
+   local body = add_arguments(args, 2, m.signature or '')
+   local pushes = {}
+   for i, t in ipairs(results) do
+      pushes[i] = pusher(t)
+   end
+
+   local reply = format('reply_%d', n)
+   emit([[
+/*
+ * Reply to %s.%s()
+ */
+static int %s(lua_State *L, DBusMessage *reply)
+{
+	DBusMessageIter args;
+
+	if (!dbus_message_has_signature(reply, "%s"))
+		return reply_error(L, reply, "%s");
+	if (!dbus_message_iter_init(reply, &args))
+		return 0;
+
+	lua_checkstack(L, %d);
+]], m.interface, m.name, reply, m.result or '', m.result or '', #pushes)
+   for i, push in ipairs(pushes) do
+      if i > 1 then
+         emit('\tdbus_message_iter_next(&args);\n')
+      end
+      emit('\t%s(L, &args);\n', push)
+   end
+   emit('\treturn %d;\n}\n\n', #pushes)
+
+   local name = format('call_%d', n)
+   local top = #args + 1
+   emit([[
+/*
+ * %s.%s()
+ *
+ * argument 1: proxy
+ * ...
+ */
+static int %s(lua_State *L)
+{
+	DBusMessage *msg;
+	DBusMessageIter args;
+
+	lua_settop(L, %d);
+	proxy_push(L);
+
+	msg = dbus_message_new_method_call(lua_tostring(L, %d),
+			lua_tostring(L, %d), "%s", "%s");
+	if (msg == NULL) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "Out of memory");
+		return 2;
+	}
+
+	dbus_message_iter_init_append(msg, &args);
+]], m.interface, m.name, name, top, top + 2, top + 3, m.interface, m.name)
+   body()
+   emit('\n\treturn simpledbus_call(L, %d, msg, %s);\n}\n\n', top + 1, reply)
+
+   return name
+end
+
+local function signal(s, n)
+   local args = parse_signature(s.signature or '')
+   local body = add_arguments(args, 3, s.signature or '')
+   local name = format('emit_%d', n)
+
+   emit([[
+/*
+ * %s.%s
+ *
+ * argument 1: bus
+ * argument 2: object path
+ * ...
+ */
+static int %s(lua_State *L)
+{
+	const char *path = luaL_checkstring(L, 2);
+	DBusMessage *msg;
+	DBusMessageIter args;
+
+	if (!dbus_validate_path(path, NULL)) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "Invalid object path");
+		return 2;
+	}
+
+	lua_settop(L, %d);
+	msg = dbus_message_new_signal(path, "%s", "%s");
+	if (msg == NULL) {
+		lua_pushnil(L);
+		lua_pushliteral(L, "Out of memory");
+		return 2;
+	}
+
+	dbus_message_iter_init_append(msg, &args);
+]], s.interface, s.name, name, #args + 2, s.interface, s.name)
+   body()
+   emit('\n\treturn simpledbus_send(L, 1, msg);\n}\n\n')
+
+   return name
+end
+
+local preamble = [[
+/*
+ * Generated by bindgen.lua from %s, don't edit.
+ */
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <dbus/dbus.h>
+
+#include <simpledbus.h>
+
+static int add_error(lua_State *L, int index, int expected)
+{
+	lua_pushfstring(L, "(%%s expected, got %%s)",
+			lua_typename(L, expected),
+			lua_typename(L, lua_type(L, index)));
+	return 1;
+}
+
+static int marshal_error(lua_State *L, DBusMessage *msg,
+		int i, const char *signature)
+{
+	dbus_message_unref(msg);
+	lua_pushfstring(L, "type error adding value #%%d of '%%s' ",
+			i, signature);
+	lua_insert(L, -2);
+	lua_concat(L, 2);
+	return lua_error(L);
+}
+
+static int reply_error(lua_State *L, DBusMessage *reply,
+		const char *signature)
+{
+	lua_pushnil(L);
+	lua_pushfstring(L, "Expected reply with signature '%%s', got '%%s'",
+			signature, dbus_message_get_signature(reply));
+	return 2;
+}
+
+/*
+ * Push the bus, target and object of the proxy at index 1.
+ * A pool picks the connection like Method.__call does.
+ */
+static void proxy_push(lua_State *L)
+{
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_getfield(L, 1, "bus");
+	if (lua_istable(L, -1)) {
+		lua_getfield(L, -1, "pick");
+		lua_insert(L, -2);
+		lua_getfield(L, 1, "target");
+		lua_call(L, 2, 1);
+	}
+	lua_getfield(L, 1, "target");
+	lua_getfield(L, 1, "object");
+}
+
+]]
+
+local function generate(modname, filename, xml)
+   local proxy = DBus.Bus.new_proxy(nil, '', '/')
+   local r, msg = proxy:parse(xml)
+   if not r then
+      return nil, msg
+   end
+
+   -- sort the members so the output is the same every time
+   local methods, signals = {}, {}
+   for name, v in pairs(proxy) do
+      local mt = getmetatable(v)
+      if mt == DBus.Method then
+         methods[#methods + 1] = v
+      elseif mt == DBus.Signal then
+         signals[#signals + 1] = v
+      end
+   end
+   local function byname(a, b) return a.name < b.name end
+   table.sort(methods, byname)
+   table.sort(signals, byname)
+
+   emit(preamble, filename)
+
+   local mfuncs, sfuncs = {}, {}
+   for i, m in ipairs(methods) do
+      mfuncs[i] = { m.name, method(m, i) }
+   end
+   for i, s in ipairs(signals) do
+      sfuncs[i] = { s.name, signal(s, i) }
+   end
+
+   local function reg(name, funcs)
+      emit('static const luaL_Reg %s[] = {\n', name)
+      for _, f in ipairs(funcs) do
+         emit('\t{"%s", %s},\n', f[1], f[2])
+      end
+      emit('\t{NULL, NULL}\n};\n\n')
+   end
+   reg('methods', mfuncs)
+   reg('signals', sfuncs)
+
+   emit([[
+static void set_functions(lua_State *L, const luaL_Reg *p)
+{
+	for (; p->name; p++) {
+		lua_pushcclosure(L, p->func, 0);
+		lua_setfield(L, -2, p->name);
+	}
+}
+
+LUALIB_API int luaopen_%s(lua_State *L)
+{
+	/* the functions in simpledbus.h need simpledbus.core */
+	lua_getglobal(L, "require");
+	lua_pushliteral(L, "simpledbus.core");
+	lua_call(L, 1, 0);
+
+	lua_createtable(L, 0, 2);
+
+	lua_createtable(L, 0, %d);
+	set_functions(L, methods);
+	lua_setfield(L, -2, "methods");
+
+	lua_createtable(L, 0, %d);
+	set_functions(L, signals);
+	lua_setfield(L, -2, "signals");
+
+	return 1;
+}
+]], (modname:gsub('%.', '_')), #mfuncs, #sfuncs)
+
+   return concat(out)
+end
+
+local modname, input, output = arg[1], arg[2], arg[3]
+if not modname or not input then
+   io.stderr:write(usage)
+   os.exit(1)
+end
+
+local f, msg = io.open(input)
+if not f then
+   io.stderr:write(msg, '\n')
+   os.exit(1)
+end
+local xml = f:read('*a')
+f:close()
+
+local ok, code, msg = pcall(generate, modname, input, xml)
+if not ok then
+   msg = code
+elseif code then
+   f, msg = io.open(output or '/dev/stdout', 'w')
+   if f then
+      f:write(code)
+      f:close()
+      os.exit(0)
+   end
+end
+io.stderr:write('bindgen.lua: ', msg, '\n')
+os.exit(1)
+
+-- vi: syntax=lua ts=3 sw=3 et: